@@ -0,0 +1,118 @@
+/*
+* Copyright 2017 Ingemar Larsson & Lars Gunder Knudsen / empiriKit
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+*/
+
+#include <stdlib.h>
+
+#include "Gesture.h"
+
+GestureDetector::GestureDetector() {
+    settings.tapMaxMs = 250;
+    settings.holdMinMs = 800;
+    settings.stillMaxMm = 4;
+    settings.swipeMinMm = 12;
+    settings.swipeMinSpeed = 60;
+
+    _position = 0;
+    _velocity = 0;
+    _historyCount = 0;
+    _startPosition = 0;
+    _startTime = 0;
+    _reported = false;
+    _queueHead = 0;
+    _queueTail = 0;
+    _dropped = 0;
+}
+
+void GestureDetector::post(GESTURE_TYPE gesture) {
+    // Single producer (update) and consumer (read), the indices only grow
+    if (_queueHead - _queueTail >= GESTURE_QUEUE_LENGTH) {
+        _dropped++;
+        return;
+    }
+    _queue[_queueHead & (GESTURE_QUEUE_LENGTH - 1)] = gesture;
+    _queueHead++;
+}
+
+GESTURE_TYPE GestureDetector::read() {
+    if (_queueTail == _queueHead)
+        return GESTURE_NONE;
+
+    GESTURE_TYPE gesture = (GESTURE_TYPE)_queue[_queueTail & (GESTURE_QUEUE_LENGTH - 1)];
+    _queueTail++;
+    return gesture;
+}
+
+void GestureDetector::update(int position, uint32_t us) {
+    if (position <= 0) {
+        // Release: a short touch that stayed in place is a tap
+        if (_position > 0 && !_reported &&
+            (us - _startTime) <= (uint32_t)settings.tapMaxMs * 1000 &&
+            abs(_position - _startPosition) <= settings.stillMaxMm)
+            post(GESTURE_TAP);
+
+        _position = 0;
+        _velocity = 0;
+        _historyCount = 0;
+        return;
+    }
+
+    if (_position == 0) {
+        _startPosition = position;
+        _startTime = us;
+        _reported = false;
+    }
+    _position = position;
+
+    // Keep the last readings, oldest first
+    if (_historyCount == GESTURE_HISTORY_LENGTH) {
+        for (int i = 1; i < GESTURE_HISTORY_LENGTH; i++) {
+            _historyPosition[i-1] = _historyPosition[i];
+            _historyTime[i-1] = _historyTime[i];
+        }
+        _historyCount--;
+    }
+    _historyPosition[_historyCount] = position;
+    _historyTime[_historyCount] = us;
+    _historyCount++;
+
+    uint32_t window = us - _historyTime[0];
+    _velocity = window ? (int32_t)(position - _historyPosition[0]) * 1000000 / (int32_t)window : 0;
+
+    if (_reported)
+        return;
+
+    // Swipes are reported while the finger is still moving (no wait for the release)
+    int moved = position - _startPosition;
+    if (abs(moved) >= settings.swipeMinMm && abs(_velocity) >= settings.swipeMinSpeed &&
+        (moved > 0) == (_velocity > 0)) {
+        post(moved > 0 ? GESTURE_SWIPE_RIGHT : GESTURE_SWIPE_LEFT);
+        _reported = true;
+    } else if ((us - _startTime) >= (uint32_t)settings.holdMinMs * 1000 && abs(moved) <= settings.stillMaxMm) {
+        post(GESTURE_HOLD);
+        _reported = true;
+    }
+}
+
+const char * gestureName(GESTURE_TYPE gesture) {
+    switch (gesture) {
+        case GESTURE_TAP:           return "Tap";
+        case GESTURE_HOLD:          return "Hold";
+        case GESTURE_SWIPE_LEFT:    return "SwipeLeft";
+        case GESTURE_SWIPE_RIGHT:   return "SwipeRight";
+        default:                    return "None";
+    }
+}
@@ -0,0 +1,89 @@
+/*
+* Copyright 2017 Ingemar Larsson & Lars Gunder Knudsen / empiriKit
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+*/
+
+#ifndef GESTURE_H
+#define GESTURE_H
+
+#include <stdint.h>
+
+#define GESTURE_HISTORY_LENGTH  8   // Slider readings used for the velocity
+#define GESTURE_QUEUE_LENGTH    4   // Recognized gestures not yet read, a power of two
+
+enum GESTURE_TYPE
+{
+    GESTURE_NONE,
+    GESTURE_TAP,            // Short touch without movement, reported on release
+    GESTURE_HOLD,           // Long touch without movement, reported while still touching
+    GESTURE_SWIPE_LEFT,     // Towards lower slider positions, reported as soon as recognized
+    GESTURE_SWIPE_RIGHT,
+};
+
+struct GestureSettings {
+    uint16_t tapMaxMs;      // Longest touch that is a tap
+    uint16_t holdMinMs;     // Shortest touch that is a hold
+    uint8_t stillMaxMm;     // Largest movement of a tap or hold
+    uint8_t swipeMinMm;     // Shortest swipe
+    uint16_t swipeMinSpeed; // Slowest swipe, mm/s over the history window
+};
+
+// Recognizes gestures from the touch slider position (mm, 0 = no touch).
+// update() is meant to be called at a fixed rate from a Ticker, it queues
+// the gestures for the main loop, which takes them with read(). A touch is
+// reported as at most one gesture.
+class GestureDetector {
+public:
+    GestureDetector();
+
+    // ISR safe (single caller)
+    void update(int position, uint32_t us);
+
+    // Main loop only, GESTURE_NONE when there are no more gestures
+    GESTURE_TYPE read();
+
+    int position() { return _position; }
+    int velocity() { return _velocity; }   // mm/s, positive towards higher positions
+    uint32_t dropped() { return _dropped; }
+
+    GestureSettings settings;
+
+private:
+    void post(GESTURE_TYPE gesture);
+
+    volatile uint8_t _position;
+    volatile int16_t _velocity;
+
+    uint8_t _historyPosition[GESTURE_HISTORY_LENGTH];
+    uint32_t _historyTime[GESTURE_HISTORY_LENGTH];
+    int _historyCount;
+
+    uint8_t _startPosition;
+    uint32_t _startTime;
+    bool _reported;         // The current touch has been reported
+
+    volatile uint8_t _queue[GESTURE_QUEUE_LENGTH];
+    volatile uint32_t _queueHead;
+    volatile uint32_t _queueTail;
+    volatile uint32_t _dropped;
+};
+
+const char * gestureName(GESTURE_TYPE gesture);
+
+inline bool gestureIsSwipe(GESTURE_TYPE gesture) {
+    return gesture == GESTURE_SWIPE_LEFT || gesture == GESTURE_SWIPE_RIGHT;
+}
+
+#endif
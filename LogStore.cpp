@@ -0,0 +1,298 @@
+/*
+* Copyright 2017 Ingemar Larsson & Lars Gunder Knudsen / empiriKit
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+*/
+
+#include <string.h>
+
+#if defined(__MBED__)
+#include "mbed.h"
+#endif
+
+#include "LogStore.h"
+
+#define LOG_SESSION_MAGIC   0x534C4B45  // "EKLS"
+#define ERASED_WORD         0xFFFFFFFF
+
+#if defined(__MBED__)
+
+// End of the firmware image in flash: the code, then the initial values of .data
+#if defined(__CC_ARM)
+extern char Load$$LR$$LR_IROM1$$Limit[];
+#define FLASH_IMAGE_END ((uintptr_t)Load$$LR$$LR_IROM1$$Limit)
+#else
+extern char __etext[], __data_start__[], __data_end__[];   // GCC_ARM linker script
+#define FLASH_IMAGE_END ((uintptr_t)__etext + (__data_end__ - __data_start__))
+#endif
+
+// FTFA flash commands
+#define FTFA_CMD_PROGRAM_LONGWORD   0x06
+#define FTFA_CMD_ERASE_SECTOR       0x09
+
+#define FTFA_ERROR_MASK (FTFA_FSTAT_ACCERR_MASK | FTFA_FSTAT_FPVIOL_MASK | \
+                         FTFA_FSTAT_RDCOLERR_MASK | FTFA_FSTAT_MGSTAT0_MASK)
+
+// The flash can't be read while a command runs, so the launch and wait
+// loop must execute from RAM with interrupts disabled. It is kept as
+// Thumb code in an initialized array, which the startup code copies to
+// RAM with the rest of .data (no linker script or section changes).
+//   uint8_t ftfaLaunch(volatile uint8_t *fstat)
+static uint16_t ftfaLaunchCode[] = {
+    0x2180,     //          movs r1, #0x80      CCIF
+    0x7001,     //          strb r1, [r0]       Launch the command
+    0x7802,     // wait:    ldrb r2, [r0]
+    0x420A,     //          tst  r2, r1
+    0xD0FC,     //          beq  wait           Until CCIF is set again
+    0x7800,     //          ldrb r0, [r0]       Return FSTAT
+    0x4770      //          bx   lr
+};
+
+typedef uint8_t (*FtfaLaunch)(volatile uint8_t *fstat);
+
+static bool ftfaCommand(uint8_t cmd, uint32_t address, uint32_t word) {
+    // Clear errors from a previous command
+    FTFA->FSTAT = FTFA_FSTAT_ACCERR_MASK | FTFA_FSTAT_FPVIOL_MASK | FTFA_FSTAT_RDCOLERR_MASK;
+
+    FTFA->FCCOB0 = cmd;
+    FTFA->FCCOB1 = (address >> 16) & 0xFF;
+    FTFA->FCCOB2 = (address >> 8) & 0xFF;
+    FTFA->FCCOB3 = address & 0xFF;
+    FTFA->FCCOB4 = (word >> 24) & 0xFF;
+    FTFA->FCCOB5 = (word >> 16) & 0xFF;
+    FTFA->FCCOB6 = (word >> 8) & 0xFF;
+    FTFA->FCCOB7 = word & 0xFF;
+
+    __disable_irq();
+    uint8_t status = ((FtfaLaunch)((uintptr_t)ftfaLaunchCode | 1))(&FTFA->FSTAT);
+    __enable_irq();
+
+    return !(status & FTFA_ERROR_MASK);
+}
+
+// The address checks keep a firmware image that grew into the store intact
+bool LogStore::eraseSector(uintptr_t address) {
+    if (address < FLASH_IMAGE_END)
+        return false;
+    return ftfaCommand(FTFA_CMD_ERASE_SECTOR, address, 0);
+}
+
+bool LogStore::programWord(uintptr_t address, uint32_t word) {
+    if (address < FLASH_IMAGE_END)
+        return false;
+    return ftfaCommand(FTFA_CMD_PROGRAM_LONGWORD, address, word);
+}
+
+uintptr_t LogStore::imageEnd() {
+    return FLASH_IMAGE_END;
+}
+
+#else
+
+// No flash off target, the host tests provide a simulated one
+bool LogStore::eraseSector(uintptr_t) {
+    return false;
+}
+
+bool LogStore::programWord(uintptr_t, uint32_t) {
+    return false;
+}
+
+uintptr_t LogStore::imageEnd() {
+    return 0;
+}
+
+#endif
+
+LogStore::LogStore(uintptr_t base, int sectors, int sectorSize)
+    : _base(base), _sectors(sectors), _sectorSize(sectorSize)
+{
+    _count = 0;
+    _nextSector = 0;
+    _nextId = 1;
+}
+
+bool LogStore::writable() {
+    return imageEnd() <= _base;
+}
+
+const LogSessionHeader * LogStore::header(int sector) {
+    return (const LogSessionHeader *)(_base + sector * _sectorSize);
+}
+
+bool LogStore::isValid(const LogSessionHeader * header) {
+    uint32_t settings = header->samplingRate | (header->range << 16) | (header->fastRead << 24);
+    return (header->magic == LOG_SESSION_MAGIC) && (header->check == ~(header->id ^ settings));
+}
+
+int LogStore::sessionSectors(const LogSessionHeader * header) {
+    int bytes = sizeof(LogSessionHeader) + header->length * 3 * (header->fastRead ? 1 : 2);
+    return (bytes + _sectorSize - 1) / _sectorSize;
+}
+
+// Scan the session headers and rebuild the index (sorted by id, oldest first)
+void LogStore::init() {
+    uint32_t newestId = 0;
+    int newestSector = -1;
+
+    _count = 0;
+    for (int sector = 0; sector < _sectors; sector++) {
+        const LogSessionHeader * h = header(sector);
+        if (!isValid(h))
+            continue;
+
+        if (h->id > newestId) {
+            newestId = h->id;
+            newestSector = sector;
+        }
+
+        if (h->length == ERASED_WORD || h->deleted != ERASED_WORD)
+            continue;   // Incomplete (power loss during save) or deleted
+
+        int i = _count++;
+        while (i > 0 && header(_index[i-1])->id > h->id) {
+            _index[i] = _index[i-1];
+            i--;
+        }
+        _index[i] = sector;
+    }
+
+    _nextId = newestId + 1;
+    if (newestSector < 0)
+        _nextSector = 0;
+    else if (header(newestSector)->length == ERASED_WORD)
+        _nextSector = newestSector + 1;
+    else
+        _nextSector = newestSector + sessionSectors(header(newestSector));
+
+    if (_nextSector >= _sectors)
+        _nextSector = 0;
+}
+
+int LogStore::sessionCount() {
+    return _count;
+}
+
+const LogSessionHeader * LogStore::session(int index) {
+    if (index < 0 || index >= _count)
+        return 0;
+
+    return header(_index[index]);
+}
+
+const LogSessionHeader * LogStore::findSession(uint32_t id) {
+    for (int i = 0; i < _count; i++) {
+        if (header(_index[i])->id == id)
+            return header(_index[i]);
+    }
+    return 0;
+}
+
+const void * LogStore::sessionData(const LogSessionHeader * header) {
+    return header + 1;
+}
+
+bool LogStore::prepareSector(int sector) {
+    const uint32_t * word = (const uint32_t *)header(sector);
+    for (int i = 0; i < _sectorSize / 4; i++) {
+        if (word[i] != ERASED_WORD)
+            return eraseSector(_base + sector * _sectorSize);
+    }
+    return true;
+}
+
+uint32_t LogStore::save(const void * data, int length, int range, int fastRead, int samplingRate) {
+    int bytes = length * 3 * (fastRead ? 1 : 2);
+    int needed = (sizeof(LogSessionHeader) + bytes + _sectorSize - 1) / _sectorSize;
+
+    if (length <= 0 || needed > _sectors || !writable())
+        return 0;
+
+    // Sessions are never split across the end of the area. The sectors
+    // left at the end hold the oldest sessions, they go before any at the
+    // start so eviction stays oldest first and every sector is reused.
+    if (_nextSector + needed > _sectors) {
+        for (int sector = _nextSector; sector < _sectors; sector++) {
+            if (!prepareSector(sector)) {
+                init();
+                return 0;
+            }
+        }
+        _nextSector = 0;
+    }
+
+    for (int i = 0; i < needed; i++) {
+        if (!prepareSector(_nextSector + i)) {
+            init();
+            return 0;
+        }
+    }
+
+    uint32_t id = _nextId;
+    uintptr_t address = _base + _nextSector * _sectorSize;
+    uint32_t settings = samplingRate | (range << 16) | (fastRead << 24);
+    bool ok = programWord(address, LOG_SESSION_MAGIC) &&
+              programWord(address + 4, id) &&
+              programWord(address + 8, settings) &&
+              programWord(address + 12, ~(id ^ settings));
+
+    // Data follows the header, the last word is padded with erased bytes
+    const uint8_t * src = (const uint8_t *)data;
+    uintptr_t dst = address + sizeof(LogSessionHeader);
+    for (int i = 0; ok && i < bytes; i += 4) {
+        uint32_t word = ERASED_WORD;
+        memcpy(&word, &src[i], (bytes - i) < 4 ? (bytes - i) : 4);
+        ok = programWord(dst + i, word);
+    }
+
+    // Writing the length last marks the session as complete
+    ok = ok && programWord(address + 16, length);
+
+    init();
+    return ok ? id : 0;
+}
+
+bool LogStore::erase(uint32_t id) {
+    const LogSessionHeader * h = findSession(id);
+    if (!h || !writable())
+        return false;
+
+    bool ok = programWord((uintptr_t)&h->deleted, 0);
+    init();
+    return ok;
+}
+
+bool LogStore::eraseAll() {
+    if (!writable())
+        return false;
+
+    bool ok = true;
+    for (int sector = 0; sector < _sectors; sector++)
+        ok = prepareSector(sector) && ok;
+
+    init();
+    return ok;
+}
+
+int LogStore::freeSectors() {
+    if (_count == 0)
+        return _sectors;
+
+    // Sectors that can be written before the oldest kept session is reached
+    int oldest = _index[0];
+    int free = oldest - _nextSector;
+    if (free < 0)
+        free += _sectors;
+    return free;
+}
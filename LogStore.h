@@ -0,0 +1,92 @@
+/*
+* Copyright 2017 Ingemar Larsson & Lars Gunder Knudsen / empiriKit
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+*/
+
+#ifndef LOG_STORE_H
+#define LOG_STORE_H
+
+#include <stdint.h>
+
+#include "MemoryMap.h"
+
+// Header written at the start of the first sector of each session.
+// Flash can only clear bits, so 'length' and 'deleted' are left erased
+// when the session is opened and programmed later.
+struct LogSessionHeader {
+    uint32_t magic;
+    uint32_t id;
+    uint16_t samplingRate;
+    uint8_t  range;
+    uint8_t  fastRead;
+    uint32_t check;     // ~(id ^ settings), guards against sample data that looks like a header
+    uint32_t length;    // Number of XYZ samples, erased until the session is complete
+    uint32_t deleted;   // Erased = valid, 0 = deleted
+};
+
+// Append-only session store in internal flash.
+//
+// Sessions start on a sector boundary and are written one after the
+// other. When a session doesn't fit before the end of the area, the
+// sectors left there are erased and writing wraps around; the oldest
+// sectors are erased as they are reused, so sessions are evicted oldest
+// first and all sectors wear evenly. The index is rebuilt from the
+// session headers at boot.
+class LogStore {
+public:
+    LogStore(uintptr_t base, int sectors, int sectorSize);
+
+    void init();
+
+    // False if the store overlaps the firmware image, nothing is then erased or written
+    bool writable();
+
+    int sessionCount();
+    const LogSessionHeader * session(int index);
+    const LogSessionHeader * findSession(uint32_t id);
+    const void * sessionData(const LogSessionHeader * header);
+
+    // Returns the id of the new session, 0 on failure
+    uint32_t save(const void * data, int length, int range, int fastRead, int samplingRate);
+
+    bool erase(uint32_t id);
+    bool eraseAll();
+
+    int freeSectors();
+
+protected:
+    // Overridden by the simulated flash of the host tests
+    virtual bool eraseSector(uintptr_t address);
+    virtual bool programWord(uintptr_t address, uint32_t word);
+    virtual uintptr_t imageEnd();   // First address after the firmware image
+
+    uintptr_t _base;
+
+private:
+    const LogSessionHeader * header(int sector);
+    bool isValid(const LogSessionHeader * header);
+    int sessionSectors(const LogSessionHeader * header);
+    bool prepareSector(int sector);
+
+    int _sectors;
+    int _sectorSize;
+
+    uint8_t _index[LOG_STORE_MAX_SECTORS];  // Sector of each session, oldest first
+    int _count;
+    int _nextSector;
+    uint32_t _nextId;
+};
+
+#endif
@@ -0,0 +1,121 @@
+/*
+* Copyright 2017 Ingemar Larsson & Lars Gunder Knudsen / empiriKit
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+*/
+
+#ifndef MEMORY_MAP_H
+#define MEMORY_MAP_H
+
+#include <stdint.h>
+
+#include "Trace.h"
+
+// All application buffers live in one statically sized arena (no heap
+// allocation at boot). Whatever is not used by the I/O buffers goes to
+// the accelerometer log. See "Memory budget" in README.md.
+
+// The toolchain defaults to gnu++98, so no static_assert
+#define MEMORY_MAP_ASSERT(cond, name) typedef char memory_map_assert_##name[(cond) ? 1 : -1]
+
+#if defined(TARGET_KL25Z)
+#define TARGET_RAM_SIZE     (16*1024)
+#define ARENA_SIZE          (6*1024)
+#elif defined(TARGET_KL46Z)
+#define TARGET_RAM_SIZE     (32*1024)
+#define ARENA_SIZE          (22*1024)
+#endif
+
+// RAM that must be left for the heap (mbed runtime, USB stack) and the stack
+// after all static data, the arena included. Checked here against the arena
+// alone; the compiler can't see the static data of mbed and the USB stack,
+// so the full check is at boot against the linker's end of .bss (see
+// ramFree() in main.cpp).
+#define RAM_MIN_FREE        (2*1024)
+
+#define RX_BUF_SIZE         256     // Incoming commands
+#define TX_BUF_SIZE         200     // Formatting of outgoing messages
+#define TRACE_LENGTH        32      // Trace events, a power of two
+#define STREAM_FIFO_LENGTH  8       // Stream samples held back for the drop oldest policy
+
+// A StreamData message with all fields, and a notification sent with it
+#if defined(TARGET_KL46Z)
+#define STREAM_MSG_SIZE     400
+#else
+#define STREAM_MSG_SIZE     336
+#endif
+
+// Magnetometer (XYZ) and light sensor logs, KL46Z only
+#if defined(TARGET_KL46Z)
+#define MAG_LOG_LENGTH      640
+#define LIGHT_LOG_LENGTH    640
+#define AUX_LOG_BYTES       (MAG_LOG_LENGTH*3*sizeof(int16_t) + LIGHT_LOG_LENGTH*sizeof(uint16_t))
+#else
+#define AUX_LOG_BYTES       0
+#endif
+
+// Log size in int16_t, a whole number of XYZ samples
+#define ACC_LOG_SIZE        ((((ARENA_SIZE - RX_BUF_SIZE - TX_BUF_SIZE - TRACE_LENGTH*sizeof(TraceEvent) - \
+                               STREAM_FIFO_LENGTH*sizeof(StreamSample) - STREAM_MSG_SIZE - AUX_LOG_BYTES) / sizeof(int16_t)) / 3) * 3)
+#define ACC_LOG_LENGTH      (ACC_LOG_SIZE/3)
+
+// One sample of the stream, 'fields' says which values are present
+struct StreamSample {
+    uint32_t tick;
+    uint32_t seq;           // Counts generated samples, gaps show dropped ones
+    int16_t acc[3];
+    int16_t mag[3];
+    uint16_t light;
+    uint8_t touch;
+    uint8_t fields;
+};
+
+struct Arena {
+    int16_t accLog[ACC_LOG_SIZE];
+    uint8_t rbuf[RX_BUF_SIZE];
+    char sbuf[TX_BUF_SIZE];
+    TraceEvent trace[TRACE_LENGTH];
+    StreamSample streamFifo[STREAM_FIFO_LENGTH];
+    char streamMsg[STREAM_MSG_SIZE];
+#if defined(TARGET_KL46Z)
+    int16_t magLog[MAG_LOG_LENGTH*3];
+    uint16_t lightLog[LIGHT_LOG_LENGTH];
+#endif
+};
+
+MEMORY_MAP_ASSERT(sizeof(Arena) <= ARENA_SIZE, arena_fits);
+MEMORY_MAP_ASSERT(ARENA_SIZE + RAM_MIN_FREE <= TARGET_RAM_SIZE, arena_fits_target_ram);
+MEMORY_MAP_ASSERT((TRACE_LENGTH & (TRACE_LENGTH - 1)) == 0, trace_length_power_of_two);
+#if defined(MAX_PACKET_SIZE_EPBULK)
+MEMORY_MAP_ASSERT(RX_BUF_SIZE > 2*MAX_PACKET_SIZE_EPBULK, rbuf_holds_packets);
+#endif
+
+// The upper part of the internal flash holds the persistent log store, the
+// firmware image must stay below LOG_STORE_BASE
+#if defined(TARGET_KL25Z)
+#define TARGET_FLASH_SIZE   (128*1024)
+#define LOG_STORE_SIZE      (64*1024)
+#elif defined(TARGET_KL46Z)
+#define TARGET_FLASH_SIZE   (256*1024)
+#define LOG_STORE_SIZE      (128*1024)
+#endif
+
+#define FLASH_SECTOR_SIZE       1024
+#define LOG_STORE_BASE          (TARGET_FLASH_SIZE - LOG_STORE_SIZE)
+#define LOG_STORE_SECTORS       (LOG_STORE_SIZE / FLASH_SECTOR_SIZE)
+#define LOG_STORE_MAX_SECTORS   128
+
+MEMORY_MAP_ASSERT(LOG_STORE_SECTORS <= LOG_STORE_MAX_SECTORS, log_store_index_fits);
+
+#endif
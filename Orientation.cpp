@@ -0,0 +1,97 @@
+/*
+* Copyright 2017 Ingemar Larsson & Lars Gunder Knudsen / empiriKit
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+*/
+
+#include "Orientation.h"
+
+#define CORDIC_ITERATIONS   16
+#define CORDIC_INPUT_SHIFT  14      // 16-bit inputs times the CORDIC gain (and sqrt(3)) still fit 31 bits
+#define CORDIC_ANGLE_SHIFT  8       // Angles are kept in centidegrees << 8
+#define CORDIC_INV_GAIN_Q15 19898   // 1 / 1.646760 in Q15
+
+// atan(2^-i) in centidegrees << 8
+static const int32_t cordicAngles[CORDIC_ITERATIONS] = {
+    1152000, 680065, 359328, 182400, 91554, 45822, 22916, 11459,
+    5730, 2865, 1432, 716, 358, 179, 90, 45,
+};
+
+// Vectoring mode on inputs already scaled by CORDIC_INPUT_SHIFT. Returns
+// the angle in centidegrees << CORDIC_ANGLE_SHIFT and the gain corrected
+// magnitude in the input scale.
+static int32_t cordicVectoring(int32_t y, int32_t x, int32_t * magnitude) {
+    int32_t angle = 0;
+
+    // No direction, the iterations below would drive the angle to -99.88 degrees
+    if (x == 0 && y == 0) {
+        *magnitude = 0;
+        return 0;
+    }
+
+    // Vectoring only converges for -90..90 degrees, so rotate the left half plane by 180
+    if (x < 0) {
+        angle = (y >= 0) ? (18000 << CORDIC_ANGLE_SHIFT) : -(18000 << CORDIC_ANGLE_SHIFT);
+        x = -x;
+        y = -y;
+    }
+
+    for (int i = 0; i < CORDIC_ITERATIONS; i++) {
+        int32_t xi = x;
+        if (y > 0) {
+            x += y >> i;
+            y -= xi >> i;
+            angle += cordicAngles[i];
+        } else {
+            x -= y >> i;
+            y += xi >> i;
+            angle -= cordicAngles[i];
+        }
+    }
+
+    *magnitude = (int32_t)(((int64_t)x * CORDIC_INV_GAIN_Q15 + (1 << 14)) >> 15);
+    return angle;
+}
+
+static int32_t roundShift(int32_t value, int shift) {
+    return (value + (1 << (shift - 1))) >> shift;
+}
+
+int32_t cordicAtan2(int32_t y, int32_t x, int32_t * magnitude) {
+    int32_t m;
+    int32_t angle = cordicVectoring(y << CORDIC_INPUT_SHIFT, x << CORDIC_INPUT_SHIFT, &m);
+
+    if (magnitude)
+        *magnitude = roundShift(m, CORDIC_INPUT_SHIFT);
+
+    return roundShift(angle, CORDIC_ANGLE_SHIFT);
+}
+
+void computeOrientation(const int16_t * xyz, Orientation * orientation) {
+    int32_t x = (int32_t)xyz[0] << CORDIC_INPUT_SHIFT;
+    int32_t y = (int32_t)xyz[1] << CORDIC_INPUT_SHIFT;
+    int32_t z = (int32_t)xyz[2] << CORDIC_INPUT_SHIFT;
+    int32_t yz, m;
+
+    // sqrt(y^2 + z^2) stays in the scaled domain for the pitch pass
+    orientation->roll = roundShift(cordicVectoring(y, z, &yz), CORDIC_ANGLE_SHIFT);
+    orientation->pitch = roundShift(cordicVectoring(-x, yz, &m), CORDIC_ANGLE_SHIFT);
+    orientation->magnitude = roundShift(m, CORDIC_INPUT_SHIFT);
+
+    orientation->valid = orientation->magnitude >= ORIENTATION_MIN_MAGNITUDE;
+    if (!orientation->valid) {
+        orientation->pitch = 0;
+        orientation->roll = 0;
+    }
+}
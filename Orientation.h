@@ -0,0 +1,42 @@
+/*
+* Copyright 2017 Ingemar Larsson & Lars Gunder Knudsen / empiriKit
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+*/
+
+#ifndef ORIENTATION_H
+#define ORIENTATION_H
+
+#include <stdint.h>
+
+// |a| below this (in input counts) has no usable direction
+#define ORIENTATION_MIN_MAGNITUDE   2
+
+// Tilt and magnitude of the acceleration vector, computed with fixed
+// point CORDIC (the M0+ has no FPU). Against double precision atan2 and
+// sqrt over the whole int16 range, the angles are within 1 centidegree
+// and the magnitude within 3 counts (host/test/test_orientation.cpp).
+struct Orientation {
+    int16_t pitch;      // centidegrees, -9000..9000, atan2(-x, sqrt(y^2 + z^2))
+    int16_t roll;       // centidegrees, -18000..18000, atan2(y, z), 0 when y = z = 0
+    int32_t magnitude;  // |a| in the same unit as the input
+    bool valid;         // False when |a| < ORIENTATION_MIN_MAGNITUDE, pitch and roll are then 0
+};
+
+// atan2(y, x) in centidegrees (0 for 0, 0), and sqrt(x^2 + y^2) in *magnitude (if not null)
+int32_t cordicAtan2(int32_t y, int32_t x, int32_t * magnitude);
+
+void computeOrientation(const int16_t * xyz, Orientation * orientation);
+
+#endif
@@ -0,0 +1,73 @@
+/*
+* Copyright 2017 Ingemar Larsson & Lars Gunder Knudsen / empiriKit
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+*/
+
+#include "mbed.h"
+#include "us_ticker_api.h"
+
+#include "Trace.h"
+#include "MemoryMap.h"
+
+extern Arena arena;
+
+// Free running indexes, the slot is index % TRACE_LENGTH
+static volatile uint32_t traceHead = 0;
+static uint32_t traceTail = 0;
+static uint32_t traceDroppedCount = 0;
+
+void traceEvent(uint16_t id, uint16_t arg0, uint32_t arg1) {
+    // The M0+ has no LDREX/STREX, so the slot is reserved with interrupts
+    // masked for the duration of the increment only.
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    uint32_t index = traceHead++;
+    __set_PRIMASK(primask);
+
+    TraceEvent * event = &arena.trace[index % TRACE_LENGTH];
+    event->timestamp = us_ticker_read();
+    event->id = id;
+    event->arg0 = arg0;
+    event->arg1 = arg1;
+}
+
+bool traceRead(TraceEvent * event) {
+    while (true) {
+        uint32_t head = traceHead;
+
+        if (head - traceTail > TRACE_LENGTH) {
+            traceDroppedCount += head - traceTail - TRACE_LENGTH;
+            traceTail = head - TRACE_LENGTH;
+        }
+
+        if (traceTail == head)
+            return false;
+
+        *event = arena.trace[traceTail % TRACE_LENGTH];
+
+        // With the ring full, an interrupt may have reused the slot while it
+        // was copied. The copy is then torn or newer: drop it (counted above
+        // on the next pass) and read the next oldest.
+        if (traceHead - traceTail <= TRACE_LENGTH)
+            break;
+    }
+
+    traceTail++;
+    return true;
+}
+
+uint32_t traceDropped() {
+    return traceDroppedCount;
+}
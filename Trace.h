@@ -0,0 +1,48 @@
+/*
+* Copyright 2017 Ingemar Larsson & Lars Gunder Knudsen / empiriKit
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+// Binary trace ring that is cheap enough to use from interrupt context.
+// Events are drained from the main loop (GETTRC). When the ring is full,
+// the oldest events are overwritten and counted as dropped.
+
+enum TRACE_EVENT_ID
+{
+    TRACE_USB_REQUEST = 1,          // arg0: Type << 13 | Recipient << 8 | bRequest, arg1: wIndex << 16 | wValue
+    TRACE_USB_SET_CONFIGURATION,    // arg0: configuration
+    TRACE_CDC_LINE_STATE,           // arg0: wValue (DTR/RTS)
+};
+
+struct TraceEvent {
+    uint32_t timestamp;     // us
+    uint16_t id;
+    uint16_t arg0;
+    uint32_t arg1;
+};
+
+// ISR safe
+void traceEvent(uint16_t id, uint16_t arg0 = 0, uint32_t arg1 = 0);
+
+// Main loop only. Returns false when there are no more events.
+bool traceRead(TraceEvent * event);
+uint32_t traceDropped();
+
+#endif
@@ -19,12 +19,15 @@
 #include "stdint.h"
 
 #include "USBHAL.h"
+#include "us_ticker_api.h"
 #include "WebUSBCDC.h"
 #include "WebUSB.h"
 #include "WinUSB.h"
 
 #include "USBDescriptor.h"
 
+#include "Trace.h"
+
 static uint8_t cdc_line_coding[7]= {0x80, 0x25, 0x00, 0x00, 0x00, 0x00, 0x08};
 
 #define DEFAULT_CONFIGURATION (1)
@@ -43,6 +46,11 @@ static uint8_t cdc_line_coding[7]= {0x80, 0x25, 0x00, 0x00, 0x00, 0x00, 0x08};
 
 #define MAX_CDC_REPORT_SIZE MAX_PACKET_SIZE_EPBULK
 
+// SOF drift measurement
+#define SOF_WINDOW_FRAMES   1000        // 1 s of host time per measurement
+#define SOF_MAX_DRIFT_PPM   1000        // Larger deviations are glitches (suspend, reset, missed SOFs)
+#define SOF_DRIFT_FILTER    4           // Exponential average over 2^4 windows
+
 // Descriptor defines (in addition to those in USBDescriptor.h)
 #define USB_VERSION_1_1     (0x0110)
 
@@ -86,6 +94,13 @@ WebUSBCDC::WebUSBCDC(uint16_t vendor_id, uint16_t product_id, uint16_t product_r
     :  WebUSBDevice(vendor_id, product_id, product_release)
 {
     cdc_connected = false;
+    write_pending[0] = false;
+    write_pending[1] = false;
+    write_timeout_us = 0;
+    write_stalled_us = 0;
+    sof_window_started = false;
+    sof_drift = 0;
+    sof_locked = false;
     if (connect) {
         WebUSBDevice::connect();
     }
@@ -93,24 +108,15 @@ WebUSBCDC::WebUSBCDC(uint16_t vendor_id, uint16_t product_id, uint16_t product_r
 
 char endl_str[] = "\r\n";
 
-#ifdef __DEBUG
-Serial pc(USBTX, USBRX); // tx, rx
-#endif
-
 bool WebUSBCDC::USBCallback_request() {
     bool success = false;
 
     CONTROL_TRANSFER * transfer = getTransferPtr();
 
-#ifdef __DEBUG
-    if(transfer->setup.bRequest == WINUSB_VENDOR_CODE) {
-        pc.printf("Type: %02x\r\n",transfer->setup.bmRequestType.Type);
-        pc.printf("Recipient: %02x\r\n",transfer->setup.bmRequestType.Recipient);
-        pc.printf("bRequest: %02x\r\n",transfer->setup.bRequest);
-        pc.printf("wIndex: %04x\r\n",transfer->setup.wIndex);
-        pc.printf("wValue: %04x\r\n\r\n",transfer->setup.wValue);
-    }
-#endif
+    traceEvent(TRACE_USB_REQUEST,
+               (transfer->setup.bmRequestType.Type << 13) | (transfer->setup.bmRequestType.Recipient << 8) |
+               transfer->setup.bRequest,
+               (transfer->setup.wIndex << 16) | transfer->setup.wValue);
 
     // Handle the Microsoft OS Descriptors 1.0 special string descriptor request
     if ((transfer->setup.bmRequestType.Type == STANDARD_TYPE) &&
@@ -207,6 +213,7 @@ bool WebUSBCDC::USBCallback_request() {
                 success = true;
                 break;
             case CDC_SET_CONTROL_LINE_STATE:
+                traceEvent(TRACE_CDC_LINE_STATE, transfer->setup.wValue);
                 // we should handle this specifically for the CDC endpoint.
                 if (transfer->setup.wValue & CLS_DTR) {
                     cdc_connected = true;
@@ -233,10 +240,15 @@ bool WebUSBCDC::USBCallback_request() {
 // Set configuration. Return false if the
 // configuration is not supported.
 bool WebUSBCDC::USBCallback_setConfiguration(uint8_t configuration) {
+    traceEvent(TRACE_USB_SET_CONFIGURATION, configuration);
+
     if (configuration != DEFAULT_CONFIGURATION) {
         return false;
     }
 
+    write_pending[0] = false;
+    write_pending[1] = false;
+
     addEndpoint(EPINT_IN, MAX_PACKET_SIZE_EPINT);
 
     addEndpoint(EPBULK_IN, MAX_PACKET_SIZE_EPBULK);
@@ -251,11 +263,100 @@ bool WebUSBCDC::USBCallback_setConfiguration(uint8_t configuration) {
     return true;
 }
 
+// Called in ISR context every 1 ms (host time)
+// Compares whole windows of frames against the local us ticker. The
+// interrupt latency only affects the window edges, so it averages out.
+void WebUSBCDC::SOF(int frameNumber) {
+    uint32_t now = us_ticker_read();
+
+    if (!sof_window_started) {
+        sof_window_frame = frameNumber;
+        sof_window_us = now;
+        sof_window_started = true;
+        return;
+    }
+
+    // The frame number is 11 bits
+    int frames = (frameNumber - sof_window_frame) & 0x7FF;
+    if (frames < SOF_WINDOW_FRAMES)
+        return;
+
+    int32_t expected = frames * 1000;
+    int32_t error = (int32_t)(now - sof_window_us) - expected;
+    int32_t drift = (int32_t)(((int64_t)error * 1000000 * 256) / expected);
+
+    sof_window_frame = frameNumber;
+    sof_window_us = now;
+
+    if (drift > (SOF_MAX_DRIFT_PPM << 8) || drift < -(SOF_MAX_DRIFT_PPM << 8))
+        return;
+
+    if (!sof_locked) {
+        sof_drift = drift;
+        sof_locked = true;
+    } else {
+        sof_drift += (drift - sof_drift) >> SOF_DRIFT_FILTER;
+    }
+}
+
+bool WebUSBCDC::waitWriteComplete(uint8_t endpoint, bool isCDC) {
+    uint32_t start = us_ticker_read();
+    bool ok = true;
+
+    while (write_pending[isCDC]) {
+        if (!configured()) {
+            write_pending[isCDC] = false;
+            ok = false;
+            break;
+        }
+        if (endpointWriteResult(endpoint) == EP_COMPLETED) {
+            write_pending[isCDC] = false;
+        } else if (write_timeout_us && (us_ticker_read() - start) > write_timeout_us) {
+            // The packet stays queued, only this write is abandoned
+            ok = false;
+            break;
+        }
+    }
+
+    write_stalled_us += us_ticker_read() - start;
+    return ok;
+}
+
+bool WebUSBCDC::writeReady(bool isCDC) {
+    if (!configured() || (isCDC && !cdc_connected))
+        return false;
+
+    if (write_pending[isCDC] && endpointWriteResult(isCDC ? CDC_ENDPOINT_IN : WEBUSB_ENDPOINT_IN) == EP_COMPLETED)
+        write_pending[isCDC] = false;
+
+    return !write_pending[isCDC];
+}
+
+// Write/format overlap: endpointWrite copies the packet into the endpoint
+// buffer, so instead of waiting for the host to take it (as
+// USBDevice::write does) we return right away and only wait for the
+// previous packet when the next one is ready. The caller formats packet
+// n+1 while packet n is in flight, which takes the CPU time out of the
+// transfer time. The bus rate is unchanged: one packet per endpoint is
+// queued at a time, so at most one is taken per host poll (USBHAL only
+// uses the even buffer bank of the controller).
 bool WebUSBCDC::write(uint8_t * buffer, uint32_t size, bool isCDC) {
+    uint8_t endpoint = isCDC ? CDC_ENDPOINT_IN : WEBUSB_ENDPOINT_IN;
+
     if(isCDC && !cdc_connected)
         return false;
 
-    return USBDevice::write(isCDC ? CDC_ENDPOINT_IN : WEBUSB_ENDPOINT_IN, buffer, size, MAX_CDC_REPORT_SIZE);
+    if (size > MAX_CDC_REPORT_SIZE || !configured())
+        return false;
+
+    if (!waitWriteComplete(endpoint, isCDC))
+        return false;
+
+    if (endpointWrite(endpoint, buffer, size) != EP_PENDING)
+        return false;
+
+    write_pending[isCDC] = true;
+    return true;
 }
 
 bool WebUSBCDC::read(uint8_t * buffer, uint32_t * size, bool isCDC, bool blocking) {
@@ -33,16 +33,43 @@ protected:
     virtual uint8_t * stringImanufacturerDesc();
     virtual uint8_t * stringIserialDesc();
 
+    virtual void SOF(int frameNumber);
+
 public:
     bool write(uint8_t * buffer, uint32_t size, bool isCDC=false);
     bool read(uint8_t * buffer, uint32_t * size, bool isCDC=false, bool blocking=false);
 
+    // True if a write would not have to wait for the previous packet
+    bool writeReady(bool isCDC=false);
+
+    // Give up on a write after waiting this long for the host (0 = wait as long as configured)
+    void setWriteTimeout(uint32_t timeout_us) { write_timeout_us = timeout_us; }
+
+    // Total time spent waiting for the host to take IN packets
+    uint32_t writeStalledUs() { return write_stalled_us; }
+
+    // Drift of the local us ticker against the host's 1 ms SOF clock, in
+    // ppm << 8 (positive = local clock runs fast). Valid once sofLocked().
+    int32_t sofDrift() { return sof_drift; }
+    bool sofLocked() { return sof_locked; }
+
     virtual uint8_t * allowedOriginsDesc();
     virtual uint8_t * urlIlandingPage();
     virtual uint8_t * urlIallowedOrigin();
 
 private:
+    bool waitWriteComplete(uint8_t endpoint, bool isCDC);
+
     volatile bool cdc_connected;
+    volatile bool write_pending[2];     // WebUSB, CDC IN packet handed to the HAL but not yet taken by the host
+    uint32_t write_timeout_us;
+    uint32_t write_stalled_us;
+
+    bool sof_window_started;
+    int sof_window_frame;
+    uint32_t sof_window_us;
+    volatile int32_t sof_drift;
+    volatile bool sof_locked;
 };
 
 #endif
\ No newline at end of file
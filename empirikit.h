@@ -18,6 +18,12 @@
 #include "USBSerial.h"  // Virtual serial port
 #include "TSISensor.h"  // Touch sensor
 #include "MMA8451Q.h"   // Accelerometer
+#include "Orientation.h" // Tilt angles from the accelerometer
+#include "Gesture.h"    // Swipe, tap and hold on the touch slider
+
+#include "MemoryMap.h"
+
+Arena arena;
 
 #if !defined(MIN)
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
@@ -33,30 +39,308 @@
 #if defined(TARGET_KL25Z) | defined(TARGET_KL46Z)
 #define MMA8451_I2C_ADDRESS (0x1d<<1)
 MMA8451Q acc(PTE25, PTE24);
-int16_t *accLog = 0;
-int16_t *accLogPtr;
+int16_t *accLog = arena.accLog;
 int16_t accXYZ[3];
 int accLoggedDataLength = 0;
 int _accelerometerRange = 8;
+int _accelerometerDataRate = 800;   // Output data rate of the sensor itself (Hz)
+int _accelerometerFastRead = 0;     // 1 = 8-bit samples (F_READ), 0 = 14-bit samples
 int accelerometerStreaming = 0;
+int orientationStreaming = 0;
+Orientation accOrientation;
+
+// Settings in effect when the current log was recorded
+int accLogRange = 8;
+int accLogFastRead = 0;
+int accLogSamplingRate = 0;
+uint32_t accLogSession = 0;   // Id of the flash copy of the log, 0 if not saved
+int accLogPreTrigger = -1;    // Samples before the trigger, -1 if not a triggered capture
+
+// Triggered capture: accLog is used as a ring of pre + post samples
+int triggerLevel = 0;         // |a| threshold in mg, 0 = off (tap/swipe and TRIGGR always trigger)
+int triggerPreSamples = 0;
+int triggerPostSamples = 0;
+int triggerRingLength = 0;
+int triggerCount = 0;         // Samples written to the ring so far
+int triggerPostCount = -1;    // Post-trigger samples still to record, -1 = not triggered yet
+int hostTrigger = 0;
+
+// The MMA8451Q library does not expose its registers, so range, ODR and
+// F_READ are handled through a second I2C handle on the same bus.
+#define MMA_REG_OUT_X_MSB       0x01
+#define MMA_REG_XYZ_DATA_CFG    0x0E
+#define MMA_REG_CTRL_REG1       0x2A
+
+#define MMA_CTRL_REG1_ACTIVE    0x01
+#define MMA_CTRL_REG1_F_READ    0x02
+
+I2C accI2C(PTE25, PTE24);
+
+// CTRL_REG1 DR[2:0] values, index == register value (6 and 1 are 6.25 and 1.56 Hz)
+const int accDataRates[] = { 800, 400, 200, 100, 50, 12, 6, 1 };
+
+void accWriteReg(char reg, char value) {
+    char data[2] = { reg, value };
+    accI2C.write(MMA8451_I2C_ADDRESS, data, 2);
+}
+
+// Counts per g for the given settings (8192 / range for 14-bit samples)
+int accFactor(int range, int fastRead) {
+    return (8192 / range) >> (fastRead ? 6 : 0);
+}
+
+// Bytes per axis in the log buffer
+int accSampleBytes(int fastRead) {
+    return fastRead ? 1 : 2;
+}
+
+void accApplySettings() {
+    char dr = 0;
+    for (int i = 0; i < 8; i++) {
+        if (accDataRates[i] == _accelerometerDataRate)
+            dr = i;
+    }
+
+    // Range and ODR can only be changed in standby
+    accWriteReg(MMA_REG_CTRL_REG1, 0);
+    accWriteReg(MMA_REG_XYZ_DATA_CFG, _accelerometerRange >> 2);  // 2g=0, 4g=1, 8g=2
+    accWriteReg(MMA_REG_CTRL_REG1, (dr << 3) |
+                                   (_accelerometerFastRead ? MMA_CTRL_REG1_F_READ : 0) |
+                                   MMA_CTRL_REG1_ACTIVE);
+}
+
+bool accSetRange(int range) {
+    if (range != 2 && range != 4 && range != 8)
+        return false;
+
+    _accelerometerRange = range;
+    accApplySettings();
+    return true;
+}
+
+bool accSetDataRate(int rate) {
+    for (int i = 0; i < 8; i++) {
+        if (accDataRates[i] == rate) {
+            _accelerometerDataRate = rate;
+            accApplySettings();
+            return true;
+        }
+    }
+    return false;
+}
+
+bool accSetResolution(int bits) {
+    if (bits != 8 && bits != 14)
+        return false;
+
+    _accelerometerFastRead = (bits == 8);
+    accApplySettings();
+    return true;
+}
+
+// Number of XYZ samples accLog holds at the given resolution
+int accLogCapacity(int fastRead) {
+    return ACC_LOG_SIZE * sizeof(int16_t) / (3 * accSampleBytes(fastRead));
+}
+
+// Store a sample in accLog, packed as int8_t when the log is recorded with F_READ
+void accLogWrite(int sample, const int16_t *xyz) {
+    if (accLogFastRead) {
+        int8_t *accLog8 = (int8_t*)accLog + sample*3;
+        accLog8[0] = xyz[0];
+        accLog8[1] = xyz[1];
+        accLog8[2] = xyz[2];
+    } else {
+        memcpy(&accLog[sample*3], xyz, 3*sizeof(int16_t));
+    }
+}
+
+// Rotate the first 'length' samples of accLog in place so 'first' becomes sample 0
+void accLogRotate(int length, int first) {
+    int size = 3 * accSampleBytes(accLogFastRead);
+    uint8_t *log = (uint8_t*)accLog;
+    int ranges[3][2] = { { 0, first }, { first, length }, { 0, length } };
+
+    for (int r = 0; r < 3; r++) {
+        int lo = ranges[r][0];
+        int hi = ranges[r][1] - 1;
+        for (; lo < hi; lo++, hi--) {
+            for (int b = 0; b < size; b++) {
+                uint8_t tmp = log[lo*size + b];
+                log[lo*size + b] = log[hi*size + b];
+                log[hi*size + b] = tmp;
+            }
+        }
+    }
+}
+
+bool accMagnitudeAbove(const int16_t *xyz, int mg) {
+    int64_t level = (int64_t)mg * accFactor(_accelerometerRange, _accelerometerFastRead) / 1000;
+    if (level > 65535)
+        return false;   // Above any |xyz| of int16 samples
+    // 64-bit squares, the square of the level of a large mg overflows 32 bits
+    int64_t magnitude2 = (int64_t)xyz[0]*xyz[0] + (int64_t)xyz[1]*xyz[1] + (int64_t)xyz[2]*xyz[2];
+    return magnitude2 > level*level;
+}
+
+void accReadAllAxis(int16_t *xyz) {
+    if (!_accelerometerFastRead) {
+        acc.getAccAllAxis(xyz);
+        return;
+    }
+
+    // F_READ: auto-increment skips the LSB registers, so X, Y, Z MSB are adjacent
+    char reg = MMA_REG_OUT_X_MSB;
+    char res[3];
+    accI2C.write(MMA8451_I2C_ADDRESS, &reg, 1, true);
+    accI2C.read(MMA8451_I2C_ADDRESS, res, 3);
+    xyz[0] = (int8_t)res[0];
+    xyz[1] = (int8_t)res[1];
+    xyz[2] = (int8_t)res[2];
+}
 #endif
 
 // Touch sensor
-int16_t touchValue = 0;
 int touchStreaming = 0;
 TSISensor tsi;
 
+// The slider is scanned at a fixed rate from a Ticker, independent of the
+// sampling loop. This is the only TSI read, everything else uses the last
+// position (gestures.position()) and the recognized gestures.
+#define TOUCH_POLL_US   10000
+Ticker touchTicker;
+GestureDetector gestures;
+
+void touchPoll() {
+    gestures.update(tsi.readDistance(), us_ticker_read());
+}
+
 // Communication
 int sendNotifications = 0;
+int commandId = -1;     // Correlation id of the command being handled, -1 = none
+
+enum VERBOSITY_TYPE
+{
+    VERBOSITY_QUIET,
+    VERBOSITY_DEBUG,    // Report received packets and command framing
+};
+
+int verbosity = VERBOSITY_QUIET;
+
+// What the stream does when the host doesn't read fast enough
+enum OVERLOAD_TYPE
+{
+    OVERLOAD_BLOCK,         // Wait for the host (sampling stalls)
+    OVERLOAD_DROP_OLDEST,   // Keep the newest STREAM_FIFO_LENGTH samples
+    OVERLOAD_DROP_NEWEST,   // Skip samples until the host catches up
+    OVERLOAD_LOWER_RATE,    // Skip, halve the sampling rate while the host can't keep up
+};
+
+#define STREAM_WRITE_TIMEOUT_US 100000  // Drop policies: give up on any write from the main loop after this
+#define STREAM_DROPS_TO_LOWER   4       // Lower rate policy: halve the rate after this many drops in a row
+#define STREAM_RECOVER_S        5       // Lower rate policy: double it again after this long without drops
+
+int overloadPolicy = OVERLOAD_BLOCK;
+
+enum STREAM_FIELD_TYPE
+{
+    STREAM_TOUCH = 0x01,
+    STREAM_ACC = 0x02,
+    STREAM_ORIENTATION = 0x04,
+    STREAM_MAG = 0x08,
+    STREAM_LIGHT = 0x10,
+};
+
+uint32_t streamSeq = 0;
+uint32_t streamLastSentSeq = 0;
+uint32_t streamDropped = 0;
+int streamFifoHead = 0;
+int streamFifoCount = 0;
+
+// "status" of a Response
+enum STATUS_TYPE
+{
+    STATUS_OK,
+    STATUS_UNKNOWN_COMMAND,
+    STATUS_INVALID_ARGUMENT,
+    STATUS_FAILED,
+};
 
 #define DEFAULT_SAMPLING_RATE 50 // Sampling rate in Hz
-#define ACC_LOG_LENGTH (DEFAULT_SAMPLING_RATE*10) // Allow 10s sampling log for 50 Hz
-#define ACC_LOG_SIZE (ACC_LOG_LENGTH*3) // Allow 18s sampling log for 50 Hz
 #define SAMPLING_WAIT (1000/DEFAULT_SAMPLING_RATE)
 #define SAMPLING_WAIT_US (1000*SAMPLING_WAIT)
 
 int _stream_sampling_rate = DEFAULT_SAMPLING_RATE;
 int _stream_sampling_wait_us = SAMPLING_WAIT_US;
+int streamRequestedRate = DEFAULT_SAMPLING_RATE;    // Set by SETRTE, the lower rate policy returns to it
+int streamDropRun = 0;              // Lower rate policy: samples dropped in a row
+int streamSentRun = 0;              // Lower rate policy: samples sent in a row
+bool streamRateChanged = false;     // Tell the host with the next stream message
+
+// Unsent rest of a message cut short by a write timeout (drop policies).
+// It goes out before anything else, so the host never sees half a message.
+const char* streamPending = 0;
+int streamPendingLength = 0;
+bool sendDropping = false;          // The start of the current message was dropped, so is the rest
+
+#if defined(TARGET_KL46Z)
+// Magnetometer (MAG3110, on the accelerometer's I2C bus) and light sensor.
+// Both are sampled every n-th tick of the sampling rate (the master
+// timebase), so their samples stay aligned with the accelerometer and
+// slow sensors don't use bus time or bandwidth on the other ticks.
+#define MAG3110_I2C_ADDRESS         (0x0e<<1)
+#define MAG_REG_OUT_X_MSB           0x01
+#define MAG_REG_CTRL_REG1           0x10
+#define MAG_REG_CTRL_REG2           0x11
+
+#define MAG_CTRL_REG1_ACTIVE        0x01    // DR = OS = 0: 80 Hz output rate
+#define MAG_CTRL_REG2_AUTO_MRST_EN  0x80
+
+AnalogIn lightSensor(PTE22);
+
+int magRate = 0;            // Hz, 0 = off
+int lightRate = 0;          // Hz, 0 = off
+int magStreaming = 0;
+int lightStreaming = 0;
+
+// Logged magnetometer and light sensor data (see arena)
+int magLogDivider = 0;
+int lightLogDivider = 0;
+int magLoggedLength = 0;
+int lightLoggedLength = 0;
+bool magLogTruncated = false;   // Samples were due after the log was full
+bool lightLogTruncated = false;
+
+// Ticks of the sampling rate between samples of a sensor, 0 = off
+int sensorDivider(int rate) {
+    if (rate <= 0)
+        return 0;
+
+    return MAX(1, _stream_sampling_rate / rate);
+}
+
+bool sensorDue(int divider, unsigned int tick) {
+    return divider && (tick % divider) == 0;
+}
+
+void magInit() {
+    char data[2] = { MAG_REG_CTRL_REG2, (char)MAG_CTRL_REG2_AUTO_MRST_EN };
+    accI2C.write(MAG3110_I2C_ADDRESS, data, 2);
+    data[0] = MAG_REG_CTRL_REG1;
+    data[1] = MAG_CTRL_REG1_ACTIVE;
+    accI2C.write(MAG3110_I2C_ADDRESS, data, 2);
+}
+
+void magReadAllAxis(int16_t *xyz) {
+    char reg = MAG_REG_OUT_X_MSB;
+    char res[6];
+    accI2C.write(MAG3110_I2C_ADDRESS, &reg, 1, true);
+    accI2C.read(MAG3110_I2C_ADDRESS, res, 6);
+    xyz[0] = (int16_t)(((uint8_t)res[0] << 8) | (uint8_t)res[1]);
+    xyz[1] = (int16_t)(((uint8_t)res[2] << 8) | (uint8_t)res[3]);
+    xyz[2] = (int16_t)(((uint8_t)res[4] << 8) | (uint8_t)res[5]);
+}
+#endif
 
 enum STATE_TYPE
 {
@@ -68,6 +352,7 @@ enum STATE_TYPE
     GET_INFO_STATE,
     GET_HELP_STATE,
     GET_LOG_STATE,
+    TRIG_ACC_STATE,
 };
 
 const char versionString[] = "17.01.001";
@@ -75,26 +360,47 @@ const char versionString[] = "17.01.001";
 char helpString[] =
     "{\"msg\":["
     "\"CMD => Description\","
+    "\"Any command can carry an id, e.g. {'GETINF':1,'id':7}. Replies then include it and a Response with the status follows\","
     "\"GETINF => Get hardware and firmware information, ({'GETINF':1})\","
 #if defined(TARGET_KL25Z)
     "\"SETRGB => Set LED RGB color, e.g. send {'SETRGB':[255,0,0]}\","
 #elif defined(TARGET_KL46Z)
     "\"SETLCD => Set LCD string, e.g. send {'SETLCD':'1234'}\","
+    "\"MAGRTE => Set magnetometer rate for streaming and logging ({'MAGRTE':x}, Hz, rounded to SETRTE / n, 0 = off)\","
+    "\"LGTRTE => Set light sensor rate for streaming and logging ({'LGTRTE':x}, Hz, rounded to SETRTE / n, 0 = off)\","
+    "\"STRMAG => Stream magnetometer values ({'STRMAG':x}, x = 0(off) or 1(on))\","
+    "\"STRLGT => Stream light sensor values ({'STRLGT':x}, x = 0(off) or 1(on))\","
 #endif
-    "\"NOTIFY => Send state change notifications ({'NOTIFY':x}, x = 0(off) or 1(on))\","
+    "\"NOTIFY => Send state change and touch gesture notifications ({'NOTIFY':x}, x = 0(off) or 1(on))\","
+    "\"SETVRB => Set verbosity ({'SETVRB':x}, x = 0(quiet) or 1(debug messages))\","
     "\"SETRTE => Set sampling rate ({'SETRTE':x}, 1 <= x <= 100)\","
     "\"STRTCH => Stream touch values ({'STRTCH':x}, x = 0(off) or 1(on))\","
+    "\"SETGST => Set touch gesture thresholds ({'SETGST':[tap,hold,still,swipe,speed]}, tap/hold in ms, still/swipe in mm, speed in mm/s)\","
     "\"STRACC => Stream accelerometer values ({'STRTCH':x}, x = 0(off) or 1(on))\","
-    "\"LOGACC => Start logging accelerometer data ({'LOGACC':1})\","
+    "\"STRORI => Stream orientation [pitch,roll] (centidegrees, left out when |a| is near 0) and |a| (mg) ({'STRORI':x}, x = 0(off) or 1(on))\","
+    "\"SETOVL => Set stream overload policy ({'SETOVL':x}, x = 0(block), 1(drop oldest), 2(drop newest) or 3(lower rate, restored when the host keeps up))\","
+    "\"GETSTA => Get stream statistics (dropped samples, stalled us, clock drift, requested rate), ({'GETSTA':1})\","
+    "\"SETRNG => Set accelerometer range ({'SETRNG':x}, x = 2, 4 or 8 (g))\","
+    "\"SETODR => Set accelerometer data rate ({'SETODR':x}, x = 800, 400, 200, 100, 50, 12, 6 or 1)\","
+    "\"SETRES => Set accelerometer resolution ({'SETRES':x}, x = 14 or 8 (bits, 8 doubles log length))\","
+    "\"LOGACC => Start logging accelerometer data ({'LOGACC':1}), swipe the slider to start and to stop\","
+    "\"TRGACC => Start triggered capture ({'TRGACC':[l,pre,post]}, l = |a| trigger level in mg (0 = tap/swipe/TRIGGR only), stops streaming, STR*/SETRNG/SETRES fail until done)\","
+    "\"TRIGGR => Trigger a running triggered capture ({'TRIGGR':1})\","
     "\"GETLOG => Get logged accelerometer data, ({'GETLOG':1})\","
+    "\"GETORI => Get logged accelerometer data as orientation [pitch,roll,|a|], ({'GETORI':1})\","
+    "\"LSTSES => List logging sessions stored in flash, ({'LSTSES':1})\","
+    "\"GETSES => Get a stored logging session, ({'GETSES':x}, x = session id)\","
+    "\"ERSSES => Erase a stored logging session, ({'ERSSES':x}, x = session id, 0 = all)\","
+    "\"GETTRC => Get (and clear) the USB event trace, ({'GETTRC':1}, events are [us,id,arg0,arg1])\","
     "\"Visit www.empirikit.com for more information.\"]}";
 
 
 STATE_TYPE currentState;
 
-//Timers
-Timer timer;
-Timer loopTimer;
+// Sample clock: absolute deadlines on the us ticker (no reset gaps), with
+// the period corrected for the drift measured against the USB SOF clock
+uint32_t sampleDeadline = 0;
+int64_t samplePhase = 0;    // Carried over fraction of the period correction, in (us * 1000000) << 8
 
 
 
@@ -0,0 +1,398 @@
+/*
+* Copyright 2017 Ingemar Larsson & Lars Gunder Knudsen / empiriKit
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+*/
+
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "CaptureFile.h"
+
+// The structures are written as they are, keep the layout fixed
+typedef char capture_header_size[(sizeof(CaptureHeader) == 64) ? 1 : -1];
+typedef char capture_channel_size[(sizeof(CaptureChannel) == 32) ? 1 : -1];
+typedef char capture_block_size[(sizeof(CaptureBlockHeader) == 16) ? 1 : -1];
+typedef char capture_group_size[(sizeof(CaptureGroup) == 16) ? 1 : -1];
+typedef char capture_footer_size[(sizeof(CaptureFooter) == 32) ? 1 : -1];
+
+static uint64_t blockBytes(uint64_t channels, uint64_t samples) {
+    uint64_t bytes = sizeof(CaptureBlockHeader) + channels * samples * sizeof(int16_t);
+    return (bytes + 7) & ~(uint64_t)7;
+}
+
+CaptureWriter::CaptureWriter() {
+    _file = 0;
+}
+
+CaptureWriter::~CaptureWriter() {
+    close();
+}
+
+bool CaptureWriter::open(const char * path, uint32_t samplingRate, int channelCount,
+                         const char * const * names, const int32_t * scales, const int * groups,
+                         const char * device, uint32_t blockSamples) {
+    if (_file || channelCount <= 0 || channelCount > CAPTURE_MAX_CHANNELS || blockSamples == 0)
+        return false;
+
+    // Groups are numbered from 0 without holes
+    int groupCount = 0;
+    for (int i = 0; i < channelCount; i++) {
+        int group = groups ? groups[i] : 0;
+        if (group < 0 || group > groupCount)
+            return false;
+        if (group == groupCount)
+            groupCount++;
+    }
+
+    _file = fopen(path, "wb");
+    if (!_file)
+        return false;
+
+    memset(&_header, 0, sizeof(_header));
+    memcpy(_header.magic, CAPTURE_MAGIC, sizeof(_header.magic));
+    _header.version = CAPTURE_VERSION;
+    _header.channelCount = channelCount;
+    _header.groupCount = groupCount;
+    _header.blockSamples = blockSamples;
+    _header.samplingRate = samplingRate;
+    strncpy(_header.device, device, sizeof(_header.device) - 1);
+
+    _groups.assign(groupCount, Group());
+    bool ok = fwrite(&_header, sizeof(_header), 1, _file) == 1;
+    for (int i = 0; ok && i < channelCount; i++) {
+        CaptureChannel channel;
+        memset(&channel, 0, sizeof(channel));
+        strncpy(channel.name, names[i], sizeof(channel.name) - 1);
+        channel.scale = scales ? scales[i] : 1;
+        channel.group = groups ? groups[i] : 0;
+        _groups[channel.group].channels.push_back(i);
+        ok = fwrite(&channel, sizeof(channel), 1, _file) == 1;
+    }
+
+    for (int g = 0; g < groupCount; g++) {
+        _groups[g].block.assign(_groups[g].channels.size() * blockSamples, 0);
+        _groups[g].count = 0;
+        _groups[g].sampleCount = 0;
+    }
+    _offset = sizeof(CaptureHeader) + channelCount * sizeof(CaptureChannel);
+
+    if (!ok) {
+        fclose(_file);
+        _file = 0;
+    }
+    return ok;
+}
+
+bool CaptureWriter::flushBlock(Group & group, int number) {
+    if (group.count == 0)
+        return true;
+
+    CaptureBlockHeader header;
+    memset(&header, 0, sizeof(header));
+    header.firstTick = group.firstTick;
+    header.samples = group.count;
+    header.group = number;
+    header.tickStep = group.tickStep;
+
+    CaptureIndexEntry entry;
+    entry.firstTick = group.firstTick;
+    entry.offset = _offset;
+    group.index.push_back(entry);
+
+    // Only the used part of each column is written
+    bool ok = fwrite(&header, sizeof(header), 1, _file) == 1;
+    for (size_t c = 0; ok && c < group.channels.size(); c++)
+        ok = fwrite(&group.block[c * _header.blockSamples], sizeof(int16_t), group.count, _file) == group.count;
+
+    uint64_t bytes = blockBytes(group.channels.size(), group.count);
+    uint64_t padding = bytes - sizeof(header) - group.channels.size() * group.count * sizeof(int16_t);
+    static const char zeros[8] = {0};
+    ok = ok && fwrite(zeros, 1, padding, _file) == padding;
+
+    _offset += bytes;
+    group.count = 0;
+    return ok;
+}
+
+bool CaptureWriter::append(uint64_t tick, const int16_t * values, int group) {
+    if (!_file || group < 0 || group >= (int)_groups.size())
+        return false;
+
+    Group & g = _groups[group];
+
+    // The second sample sets the step, anything off it starts a new block
+    if (g.count > 0) {
+        uint64_t last = g.firstTick + (uint64_t)(g.count - 1) * g.tickStep;
+        if (tick <= last)
+            return false;
+        bool full = g.count == _header.blockSamples;
+        if (g.count == 1 && !full && tick - last <= CAPTURE_MAX_TICK_STEP)
+            g.tickStep = (uint32_t)(tick - last);
+        else if ((full || tick - last != g.tickStep) && !flushBlock(g, group))
+            return false;
+    }
+
+    if (g.count == 0) {
+        g.firstTick = tick;
+        g.tickStep = 1;
+    }
+
+    for (size_t c = 0; c < g.channels.size(); c++)
+        g.block[c * _header.blockSamples + g.count] = values[c];
+    g.count++;
+    g.sampleCount++;
+    return true;
+}
+
+bool CaptureWriter::close() {
+    if (!_file)
+        return false;
+
+    bool ok = true;
+    for (size_t g = 0; g < _groups.size(); g++)
+        ok = flushBlock(_groups[g], g) && ok;
+
+    CaptureFooter footer;
+    memset(&footer, 0, sizeof(footer));
+    footer.indexOffset = _offset;
+    memcpy(footer.magic, CAPTURE_FOOTER_MAGIC, sizeof(footer.magic));
+
+    std::vector<CaptureGroup> table(_groups.size());
+    for (size_t g = 0; g < _groups.size(); g++) {
+        std::vector<CaptureIndexEntry> & index = _groups[g].index;
+        table[g].firstEntry = footer.indexCount;
+        table[g].sampleCount = _groups[g].sampleCount;
+        if (ok && !index.empty())
+            ok = fwrite(&index[0], sizeof(CaptureIndexEntry), index.size(), _file) == index.size();
+        footer.indexCount += index.size();
+        footer.sampleCount += _groups[g].sampleCount;
+    }
+    ok = ok && fwrite(&table[0], sizeof(CaptureGroup), table.size(), _file) == table.size();
+    ok = ok && fwrite(&footer, sizeof(footer), 1, _file) == 1;
+    ok = (fclose(_file) == 0) && ok;
+
+    _file = 0;
+    _groups.clear();
+    return ok;
+}
+
+CaptureReader::CaptureReader() {
+    _data = 0;
+    _size = 0;
+}
+
+CaptureReader::~CaptureReader() {
+    close();
+}
+
+bool CaptureReader::open(const char * path) {
+    close();
+
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(CaptureHeader) + sizeof(CaptureFooter)) {
+        ::close(fd);
+        return false;
+    }
+
+    void * map = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED)
+        return false;
+
+    _data = (const uint8_t *)map;
+    _size = st.st_size;
+    _header = (const CaptureHeader *)_data;
+    _channels = (const CaptureChannel *)(_header + 1);
+    _footer = (const CaptureFooter *)(_data + _size - sizeof(CaptureFooter));
+
+    // A file without a footer was not closed (capture interrupted). The
+    // sizes are checked one by one so that none of the sums can overflow.
+    uint64_t dataStart = sizeof(CaptureHeader) + (uint64_t)_header->channelCount * sizeof(CaptureChannel);
+    uint64_t tableBytes = (uint64_t)_header->groupCount * sizeof(CaptureGroup);
+    uint64_t tail = _size - sizeof(CaptureFooter);
+    bool ok = memcmp(_header->magic, CAPTURE_MAGIC, sizeof(_header->magic)) == 0 &&
+              memcmp(_footer->magic, CAPTURE_FOOTER_MAGIC, sizeof(_footer->magic)) == 0 &&
+              _header->version == CAPTURE_VERSION &&
+              _header->channelCount > 0 && _header->channelCount <= CAPTURE_MAX_CHANNELS &&
+              _header->groupCount > 0 && _header->groupCount <= _header->channelCount &&
+              _header->blockSamples > 0 &&
+              dataStart + tableBytes <= tail &&
+              _footer->indexOffset >= dataStart && _footer->indexOffset <= tail - tableBytes &&
+              _footer->indexCount == (tail - tableBytes - _footer->indexOffset) / sizeof(CaptureIndexEntry) &&
+              _footer->indexOffset + _footer->indexCount * sizeof(CaptureIndexEntry) == tail - tableBytes;
+
+    _groups = (const CaptureGroup *)(_data + tail - tableBytes);
+    for (uint32_t g = 0; ok && g < _header->groupCount; g++) {
+        _groupChannels[g] = 0;
+        ok = _groups[g].firstEntry <= _footer->indexCount &&
+             (g == 0 ? _groups[g].firstEntry == 0 : _groups[g].firstEntry >= _groups[g - 1].firstEntry);
+    }
+    for (uint32_t c = 0; ok && c < _header->channelCount; c++) {
+        uint32_t group = _channels[c].group;
+        ok = group < _header->groupCount;
+        if (ok)
+            _channelColumn[c] = _groupChannels[group]++;
+    }
+    if (!ok) {
+        close();
+        return false;
+    }
+
+    _index = (const CaptureIndexEntry *)(_data + _footer->indexOffset);
+    return true;
+}
+
+void CaptureReader::close() {
+    if (_data)
+        munmap((void *)_data, _size);
+    _data = 0;
+    _size = 0;
+}
+
+const CaptureChannel * CaptureReader::channel(int channel) const {
+    if (channel < 0 || channel >= (int)_header->channelCount)
+        return 0;
+    return &_channels[channel];
+}
+
+int CaptureReader::findChannel(const char * name) const {
+    for (uint32_t c = 0; c < _header->channelCount; c++) {
+        if (strncmp(_channels[c].name, name, sizeof(_channels[c].name)) == 0)
+            return c;
+    }
+    return -1;
+}
+
+uint64_t CaptureReader::groupSampleCount(int group) const {
+    if (group < 0 || group >= (int)_header->groupCount)
+        return 0;
+    return _groups[group].sampleCount;
+}
+
+uint64_t CaptureReader::groupFirstBlock(int group) const {
+    if (group < 0 || group >= (int)_header->groupCount)
+        return _footer->indexCount;
+    return _groups[group].firstEntry;
+}
+
+uint64_t CaptureReader::groupEndBlock(int group) const {
+    if (group < 0 || group + 1 >= (int)_header->groupCount)
+        return _footer->indexCount;
+    return _groups[group + 1].firstEntry;
+}
+
+uint64_t CaptureReader::findBlock(uint64_t tick, int group) const {
+    uint64_t first = groupFirstBlock(group);
+    uint64_t lo = first;
+    uint64_t hi = groupEndBlock(group);
+
+    if (lo == hi)
+        return hi;
+
+    // First entry starting after tick, the block before it is the one
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (_index[mid].firstTick <= tick)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo > first ? lo - 1 : first;
+}
+
+// The block header, if the block lies within the data area and matches its index entry
+const CaptureBlockHeader * CaptureReader::block(uint64_t block) const {
+    if (block >= _footer->indexCount)
+        return 0;
+
+    uint64_t offset = _index[block].offset;
+    uint64_t dataStart = sizeof(CaptureHeader) + (uint64_t)_header->channelCount * sizeof(CaptureChannel);
+    if (offset < dataStart || offset % 8 != 0 || offset > _footer->indexOffset - sizeof(CaptureBlockHeader))
+        return 0;
+
+    const CaptureBlockHeader * header = (const CaptureBlockHeader *)(_data + offset);
+    if (header->group >= _header->groupCount || header->samples == 0 || header->samples > _header->blockSamples ||
+        header->tickStep == 0 || header->firstTick != _index[block].firstTick ||
+        blockBytes(_groupChannels[header->group], header->samples) > _footer->indexOffset - offset)
+        return 0;
+    return header;
+}
+
+uint64_t CaptureReader::blockFirstTick(uint64_t block) const {
+    return block < _footer->indexCount ? _index[block].firstTick : 0;
+}
+
+uint32_t CaptureReader::blockSamples(uint64_t block) const {
+    const CaptureBlockHeader * header = this->block(block);
+    return header ? header->samples : 0;
+}
+
+uint32_t CaptureReader::blockTickStep(uint64_t block) const {
+    const CaptureBlockHeader * header = this->block(block);
+    return header ? header->tickStep : 1;
+}
+
+int CaptureReader::blockGroup(uint64_t block) const {
+    const CaptureBlockHeader * header = this->block(block);
+    return header ? header->group : -1;
+}
+
+const int16_t * CaptureReader::column(uint64_t block, int channel) const {
+    const CaptureBlockHeader * header = this->block(block);
+    if (!header || channel < 0 || channel >= (int)_header->channelCount || _channels[channel].group != header->group)
+        return 0;
+    const int16_t * data = (const int16_t *)(header + 1);
+    return data + (size_t)_channelColumn[channel] * header->samples;
+}
+
+size_t CaptureReader::read(int channel, uint64_t tick, size_t count, int16_t * values, uint64_t * ticks) const {
+    if (channel < 0 || channel >= (int)_header->channelCount)
+        return 0;
+
+    int group = _channels[channel].group;
+    uint64_t end = groupEndBlock(group);
+    size_t n = 0;
+    for (uint64_t b = findBlock(tick, group); b < end && n < count; b++) {
+        const int16_t * data = column(b, channel);
+        if (!data)
+            continue;   // Damaged block
+
+        uint64_t first = blockFirstTick(b);
+        uint32_t samples = blockSamples(b);
+        uint32_t step = blockTickStep(b);
+        uint64_t start = (tick > first) ? (tick - first + step - 1) / step : 0;
+        if (start >= samples)
+            continue;
+        uint32_t take = samples - (uint32_t)start;
+        if (take > count - n)
+            take = count - n;
+
+        memcpy(&values[n], data + start, take * sizeof(int16_t));
+        if (ticks) {
+            for (uint32_t i = 0; i < take; i++)
+                ticks[n + i] = first + (uint64_t)(start + i) * step;
+        }
+        n += take;
+    }
+    return n;
+}
@@ -0,0 +1,186 @@
+/*
+* Copyright 2017 Ingemar Larsson & Lars Gunder Knudsen / empiriKit
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+*/
+
+#ifndef CAPTURE_FILE_H
+#define CAPTURE_FILE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include <vector>
+
+// Capture file (.ekc) layout, all little endian:
+//
+//   CaptureHeader
+//   CaptureChannel[channelCount]
+//   blocks: CaptureBlockHeader, then one int16 column of 'samples' values
+//           for each channel of the block's group, padded to 8 bytes
+//   CaptureIndexEntry[indexCount]     one per block, by group, then by firstTick
+//   CaptureGroup[groupCount]          the index entries of each group
+//   CaptureFooter
+//
+// Channels sampled together form a group (e.g. acc.x/y/z), each group has
+// its own blocks, so channels at a lower rate (magnetometer, light) take
+// no space on the ticks they were not sampled. A block holds samples at
+// a fixed tick step only, the writer starts a new block at a gap, so the
+// tick of sample i in a block is firstTick + i * tickStep. Blocks are as
+// long as their data, up to blockSamples. The index at the end gives
+// O(log n) seeks by tick without reading the data.
+
+#define CAPTURE_MAGIC           "EKCAP01"
+#define CAPTURE_FOOTER_MAGIC    "EKCAPEND"
+#define CAPTURE_VERSION         2
+#define CAPTURE_BLOCK_SAMPLES   4096
+#define CAPTURE_MAX_CHANNELS    16
+#define CAPTURE_MAX_TICK_STEP   0xFFFF
+
+struct CaptureHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t channelCount;
+    uint32_t groupCount;
+    uint32_t blockSamples;      // Longest block
+    uint32_t samplingRate;      // Hz, one tick per sampling period
+    char device[36];            // e.g. HardwareInfo uid, informational
+};
+
+struct CaptureChannel {
+    char name[24];
+    int32_t scale;              // Counts per unit, e.g. accelfactor (counts per g)
+    uint32_t group;
+};
+
+struct CaptureBlockHeader {
+    uint64_t firstTick;
+    uint32_t samples;
+    uint16_t group;
+    uint16_t tickStep;
+};
+
+struct CaptureIndexEntry {
+    uint64_t firstTick;
+    uint64_t offset;            // File offset of the CaptureBlockHeader
+};
+
+struct CaptureGroup {
+    uint64_t firstEntry;        // Index entries firstEntry..next group's firstEntry
+    uint64_t sampleCount;
+};
+
+struct CaptureFooter {
+    uint64_t indexOffset;
+    uint64_t indexCount;
+    uint64_t sampleCount;       // All groups
+    char magic[8];
+};
+
+class CaptureWriter {
+public:
+    CaptureWriter();
+    ~CaptureWriter();
+
+    // groups[c] is the group of channel c, numbered from 0 without holes
+    // (all channels in group 0 if groups is null)
+    bool open(const char * path, uint32_t samplingRate, int channelCount,
+              const char * const * names, const int32_t * scales, const int * groups = 0,
+              const char * device = "", uint32_t blockSamples = CAPTURE_BLOCK_SAMPLES);
+
+    // One value per channel of the group, in channel order. Ticks of a
+    // group must increase; a gap, a different step or a full block starts
+    // a new block.
+    bool append(uint64_t tick, const int16_t * values, int group = 0);
+
+    // Writes the last blocks, the index and the footer
+    bool close();
+
+private:
+    struct Group {
+        std::vector<int> channels;
+        std::vector<int16_t> block;         // Column major, blockSamples per channel
+        std::vector<CaptureIndexEntry> index;
+        uint64_t firstTick;
+        uint32_t count;
+        uint32_t tickStep;
+        uint64_t sampleCount;
+    };
+
+    bool flushBlock(Group & group, int number);
+
+    FILE * _file;
+    CaptureHeader _header;
+    std::vector<Group> _groups;
+    uint64_t _offset;
+};
+
+// Read-only, memory mapped access. Opening validates the header, the
+// channels, the group table and the footer, the data is paged in by the
+// OS when it is used. Blocks are checked against the file when they are
+// read: a block that doesn't fit reads as empty.
+class CaptureReader {
+public:
+    CaptureReader();
+    ~CaptureReader();
+
+    bool open(const char * path);
+    void close();
+
+    const CaptureHeader * header() const { return _header; }
+    const CaptureChannel * channel(int channel) const;
+    int findChannel(const char * name) const;
+    uint64_t sampleCount() const { return _footer->sampleCount; }
+    uint64_t blockCount() const { return _footer->indexCount; }
+
+    int groupCount() const { return _header->groupCount; }
+    uint64_t groupSampleCount(int group) const;
+
+    // Blocks of a group are first..end-1, in tick order
+    uint64_t groupFirstBlock(int group) const;
+    uint64_t groupEndBlock(int group) const;
+
+    // Last block of the group starting at or before tick (the group's
+    // first block if tick is before it, groupEndBlock() if it has none)
+    uint64_t findBlock(uint64_t tick, int group = 0) const;
+
+    uint64_t blockFirstTick(uint64_t block) const;
+    uint32_t blockSamples(uint64_t block) const;
+    uint32_t blockTickStep(uint64_t block) const;
+    int blockGroup(uint64_t block) const;
+
+    // 0 if the channel is not in the block's group or the block is damaged
+    const int16_t * column(uint64_t block, int channel) const;
+
+    // Copy up to count samples of a channel from tick on. Ticks where the
+    // channel has no sample are skipped, 'ticks' (if not null) gets the
+    // tick of each sample. Returns the number of samples copied.
+    size_t read(int channel, uint64_t tick, size_t count, int16_t * values, uint64_t * ticks = 0) const;
+
+private:
+    const CaptureBlockHeader * block(uint64_t block) const;
+
+    const uint8_t * _data;
+    size_t _size;
+    const CaptureHeader * _header;
+    const CaptureChannel * _channels;
+    const CaptureIndexEntry * _index;
+    const CaptureGroup * _groups;
+    const CaptureFooter * _footer;
+    int _groupChannels[CAPTURE_MAX_CHANNELS];
+    int _channelColumn[CAPTURE_MAX_CHANNELS];   // Column of each channel within its group's blocks
+};
+
+#endif
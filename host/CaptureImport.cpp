@@ -0,0 +1,336 @@
+/*
+* Copyright 2017 Ingemar Larsson & Lars Gunder Knudsen / empiriKit
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "CaptureFile.h"
+#include "CaptureImport.h"
+
+// The device writes flat objects with fixed key names, so a full JSON
+// parser is not needed: a message is the text between a '{' at depth 0
+// and its matching '}', and values are found by key.
+
+// Streams of the firmware before "accelfactor" was sent were always at
+// +-8 g, 1024 counts per g
+#define STREAM_DEFAULT_ACC_FACTOR   1024
+
+// Value of "key" in [begin, end), 0 if not present
+static const char * findKey(const char * begin, const char * end, const char * key) {
+    std::string quoted = std::string("\"") + key + "\"";
+    size_t len = quoted.size();
+
+    for (const char * p = begin; p + len < end; p++) {
+        if (memcmp(p, quoted.c_str(), len) != 0)
+            continue;
+        p += len;
+        while (p < end && (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t' || *p == ':'))
+            p++;
+        return p;
+    }
+    return 0;
+}
+
+static bool intValue(const char * begin, const char * end, const char * key, long * value) {
+    const char * p = findKey(begin, end, key);
+    if (!p)
+        return false;
+    *value = strtol(p, 0, 10);
+    return true;
+}
+
+// Reads up to 'max' integers of a [a,b,c] array
+static int arrayValue(const char * p, const char * end, long * values, int max) {
+    if (!p || *p != '[')
+        return 0;
+
+    int n = 0;
+    p++;
+    while (p < end && *p != ']' && n < max) {
+        char * next;
+        values[n] = strtol(p, &next, 10);
+        if (next == p)
+            break;
+        n++;
+        p = next;
+        while (p < end && (*p == ',' || *p == ' ' || *p == '\n' || *p == '\r'))
+            p++;
+    }
+    return n;
+}
+
+static bool isDatatype(const char * begin, const char * end, const char * datatype) {
+    const char * p = findKey(begin, end, "datatype");
+    size_t len = strlen(datatype);
+    return p && *p == '"' && p + len + 1 < end && memcmp(p + 1, datatype, len) == 0 && p[len + 1] == '"';
+}
+
+// End of the object starting at begin (the closing brace), 0 if unterminated
+static const char * objectEnd(const char * begin, const char * end) {
+    int depth = 0;
+    bool inString = false;
+    for (const char * p = begin; p < end; p++) {
+        if (inString) {
+            if (*p == '"')
+                inString = false;
+        } else if (*p == '"') {
+            inString = true;
+        } else if (*p == '{' || *p == '[') {
+            depth++;
+        } else if (*p == '}' || *p == ']') {
+            if (--depth == 0)
+                return p;
+        }
+    }
+    return 0;
+}
+
+static int64_t importAccelerometerLog(const char * begin, const char * end, const char * capturePath) {
+    long rate = 0, factor = 1;
+    intValue(begin, end, "samplingrate", &rate);
+    intValue(begin, end, "accelfactor", &factor);
+
+    const char * p = findKey(begin, end, "data");
+    if (!p || *p != '[')
+        return -1;
+
+    static const char * const names[] = { "acc.x", "acc.y", "acc.z" };
+    int32_t scales[3] = { (int32_t)factor, (int32_t)factor, (int32_t)factor };
+
+    CaptureWriter writer;
+    if (!writer.open(capturePath, rate, 3, names, scales))
+        return -1;
+
+    uint64_t tick = 0;
+    const char * dataEnd = objectEnd(p, end);
+    for (p = p + 1; p && dataEnd && p < dataEnd; p++) {
+        if (*p != '[')
+            continue;
+
+        long xyz[3];
+        if (arrayValue(p, dataEnd, xyz, 3) == 3) {
+            int16_t values[3] = { (int16_t)xyz[0], (int16_t)xyz[1], (int16_t)xyz[2] };
+            if (!writer.append(tick++, values))
+                break;
+        }
+        p = strchr(p, ']');
+    }
+
+    return writer.close() ? (int64_t)tick : -1;
+}
+
+// Columns found in StreamData messages
+enum {
+    STREAM_COLUMNS_ACC   = 1 << 0,
+    STREAM_COLUMNS_TOUCH = 1 << 1,
+    STREAM_COLUMNS_MAG   = 1 << 2,
+    STREAM_COLUMNS_LIGHT = 1 << 3
+};
+
+static int streamColumns(const char * begin, const char * end) {
+    int columns = 0;
+    if (findKey(begin, end, "accelerometerdata"))
+        columns |= STREAM_COLUMNS_ACC;
+    if (findKey(begin, end, "touchsensordata"))
+        columns |= STREAM_COLUMNS_TOUCH;
+    if (findKey(begin, end, "magnetometerdata"))
+        columns |= STREAM_COLUMNS_MAG;
+    if (findKey(begin, end, "lightsensordata"))
+        columns |= STREAM_COLUMNS_LIGHT;
+    return columns;
+}
+
+// Next StreamData message in [p, end), 0 if there are no more
+static const char * nextStreamData(const char * p, const char * end, const char ** objEnd) {
+    for (; p < end; p++) {
+        if (*p != '{')
+            continue;
+        *objEnd = objectEnd(p, end);
+        if (!*objEnd)
+            return 0;
+        if (isDatatype(p, *objEnd, "StreamData"))
+            return p;
+        p = *objEnd;
+    }
+    return 0;
+}
+
+// Each sensor is a group of its own, as the device sends them at their own
+// rates (a message only has the sensors due on its tick)
+static int64_t importStreamData(const char * begin, const char * end, const char * capturePath) {
+    const char * objEnd;
+    const char * p;
+    int columns = 0;
+    long rate = 0;
+    long factor = 0;
+
+    // First pass: the columns of the whole stream, the rate of the first message
+    for (p = nextStreamData(begin, end, &objEnd); p; p = nextStreamData(objEnd, end, &objEnd)) {
+        columns |= streamColumns(p, objEnd);
+        if (rate == 0)
+            intValue(p, objEnd, "samplingrate", &rate);
+        if (factor == 0)
+            intValue(p, objEnd, "accelfactor", &factor);
+    }
+    if (factor == 0)
+        factor = STREAM_DEFAULT_ACC_FACTOR;
+
+    const char * names[CAPTURE_MAX_CHANNELS];
+    int32_t scales[CAPTURE_MAX_CHANNELS];
+    int groups[CAPTURE_MAX_CHANNELS];
+    int group[4] = { -1, -1, -1, -1 };  // Of acc, touch, mag, light
+    int n = 0;
+    int g = 0;
+    if (columns & STREAM_COLUMNS_ACC) {
+        group[0] = g;
+        names[n] = "acc.x"; scales[n] = factor; groups[n++] = g;
+        names[n] = "acc.y"; scales[n] = factor; groups[n++] = g;
+        names[n] = "acc.z"; scales[n] = factor; groups[n++] = g++;
+    }
+    if (columns & STREAM_COLUMNS_TOUCH) {
+        group[1] = g;
+        names[n] = "touch"; scales[n] = 1; groups[n++] = g++;
+    }
+    if (columns & STREAM_COLUMNS_MAG) {
+        group[2] = g;
+        names[n] = "mag.x"; scales[n] = 10; groups[n++] = g;    // 0.1 uT per count
+        names[n] = "mag.y"; scales[n] = 10; groups[n++] = g;
+        names[n] = "mag.z"; scales[n] = 10; groups[n++] = g++;
+    }
+    if (columns & STREAM_COLUMNS_LIGHT) {
+        group[3] = g;
+        names[n] = "light"; scales[n] = 1; groups[n++] = g++;
+    }
+
+    CaptureWriter writer;
+    if (n == 0 || !writer.open(capturePath, rate, n, names, scales, groups))
+        return -1;
+
+    int64_t count = 0;
+    uint64_t tick = 0;
+    uint32_t lastTick = 0;
+    uint32_t message = 0;
+    bool first = true;
+    bool ok = true;
+
+    for (p = nextStreamData(begin, end, &objEnd); ok && p; p = nextStreamData(objEnd, end, &objEnd), message++) {
+        // The tick is the device's unsigned int, count the wraps. Streams of
+        // the firmware before the tick was sent have none, their messages are
+        // taken as consecutive ticks.
+        long value;
+        uint32_t deviceTick = intValue(p, objEnd, "tick", &value) ? (uint32_t)value : message;
+        if (first)
+            tick = deviceTick;
+        else
+            tick += (uint32_t)(deviceTick - lastTick);
+        lastTick = deviceTick;
+        first = false;
+
+        if (intValue(p, objEnd, "samplingrate", &value) && value != rate) {
+            fprintf(stderr, "Sampling rate changed to %ld at tick %llu, import stopped\n",
+                value, (unsigned long long)tick);
+            break;
+        }
+        // The scale is per channel, a range or resolution change (SETRNG, SETRES) can't be stored
+        if (intValue(p, objEnd, "accelfactor", &value) && value != factor) {
+            fprintf(stderr, "Accelerometer factor changed to %ld at tick %llu, import stopped\n",
+                value, (unsigned long long)tick);
+            break;
+        }
+
+        int16_t values[3];
+        long v[3];
+        const char * field;
+        if ((field = findKey(p, objEnd, "accelerometerdata")) && arrayValue(field, objEnd, v, 3) == 3) {
+            values[0] = v[0]; values[1] = v[1]; values[2] = v[2];
+            ok = ok && writer.append(tick, values, group[0]);
+            count++;
+        }
+        if (intValue(p, objEnd, "touchsensordata", &value)) {
+            values[0] = value;
+            ok = ok && writer.append(tick, values, group[1]);
+            count++;
+        }
+        if ((field = findKey(p, objEnd, "magnetometerdata")) && arrayValue(field, objEnd, v, 3) == 3) {
+            values[0] = v[0]; values[1] = v[1]; values[2] = v[2];
+            ok = ok && writer.append(tick, values, group[2]);
+            count++;
+        }
+        if (intValue(p, objEnd, "lightsensordata", &value)) {
+            // Light is 0..65535, stored as the same bits
+            values[0] = (int16_t)(uint16_t)value;
+            ok = ok && writer.append(tick, values, group[3]);
+            count++;
+        }
+    }
+
+    ok = writer.close() && ok;
+    if (count == 0)
+        return -1;
+    return ok ? count : -1;
+}
+
+int64_t captureImportJson(const char * jsonPath, const char * capturePath) {
+    // Mapped like the capture files, so a stream of several GB isn't held in RAM
+    int fd = open(jsonPath, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return -1;
+    }
+
+    void * map = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    const char * begin = (const char *)map;
+    const char * end = begin + st.st_size;
+    int64_t result = -2;
+
+    // A log file holds one AccelerometerLog, anything else is read as a stream
+    for (const char * p = begin; p < end; p++) {
+        if (*p != '{')
+            continue;
+        const char * objEnd = objectEnd(p, end);
+        if (!objEnd)
+            break;
+        if (isDatatype(p, objEnd, "AccelerometerLog")) {
+            result = importAccelerometerLog(p, objEnd, capturePath);
+            break;
+        }
+        p = objEnd;
+    }
+
+    if (result == -2)
+        result = importStreamData(begin, end, capturePath);
+
+    munmap(map, st.st_size);
+    return result;
+}
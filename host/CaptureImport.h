@@ -0,0 +1,42 @@
+/*
+* Copyright 2017 Ingemar Larsson & Lars Gunder Knudsen / empiriKit
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+*/
+
+#ifndef CAPTURE_IMPORT_H
+#define CAPTURE_IMPORT_H
+
+#include <stdint.h>
+
+// Convert a text file with the JSON messages of the device to a capture
+// file. Handled:
+//
+//   AccelerometerLog   one message, columns acc.x, acc.y, acc.z, tick = index
+//   StreamData         any number of messages, each sensor in the stream
+//                      (acc.x/y/z, touch, mag.x/y/z, light) is a channel
+//                      group of its own, holding the ticks it was sent on,
+//                      so sensors at a lower rate don't drop samples of
+//                      the others. The 32 bit device tick is unwrapped to
+//                      64 bits; messages without one (firmware before the
+//                      tick was sent) are taken as consecutive ticks. A
+//                      change of the sampling rate or of the accelerometer
+//                      factor ends the import.
+//
+// Other messages in the file (Notification, StatusMessage, ...) are
+// ignored. The file is mapped, not read into memory. Returns the number of
+// samples written (all groups), -1 on error.
+int64_t captureImportJson(const char * jsonPath, const char * capturePath);
+
+#endif
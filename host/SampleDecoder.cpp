@@ -0,0 +1,222 @@
+/*
+* Copyright 2017 Ingemar Larsson & Lars Gunder Knudsen / empiriKit
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#include "SampleDecoder.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DECODER_X86
+#include <immintrin.h>
+#endif
+
+// Integer to float is exact for int16, and the only rounding is the one
+// multiplication, so the vector paths match the scalar one bit for bit
+// (no FMA involved).
+
+static void decodeScalar(const void * frames, int bytesPerAxis, size_t count, float scale,
+                         float * x, float * y, float * z) {
+    const uint8_t * src = (const uint8_t *)frames;
+
+    if (bytesPerAxis == 1) {
+        for (size_t i = 0; i < count; i++) {
+            x[i] = (float)(int8_t)src[3*i] * scale;
+            y[i] = (float)(int8_t)src[3*i+1] * scale;
+            z[i] = (float)(int8_t)src[3*i+2] * scale;
+        }
+    } else {
+        for (size_t i = 0; i < count; i++) {
+            int16_t xyz[3];
+            memcpy(xyz, &src[6*i], sizeof(xyz));
+            x[i] = (float)xyz[0] * scale;
+            y[i] = (float)xyz[1] * scale;
+            z[i] = (float)xyz[2] * scale;
+        }
+    }
+}
+
+#if defined(DECODER_X86)
+
+// 4 frames of int16 (x0 y0 z0 x1 y1 z1 x2 y2 in v0, z2 x3 y3 z3 in the low
+// half of v1) to 4 floats per axis
+__attribute__((target("sse2")))
+static inline void sse2Frames4(__m128i v0, __m128i v1, __m128 scale, float * x, float * y, float * z) {
+    // Sign extend by unpacking with itself and shifting back
+    __m128 a = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(v0, v0), 16)), scale);
+    __m128 b = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(v0, v0), 16)), scale);
+    __m128 c = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(v1, v1), 16)), scale);
+
+    // a = x0 y0 z0 x1, b = y1 z1 x2 y2, c = z2 x3 y3 z3
+    __m128 t = _mm_shuffle_ps(b, c, _MM_SHUFFLE(1, 1, 2, 2));        // x2 x2 x3 x3
+    _mm_storeu_ps(x, _mm_shuffle_ps(a, t, _MM_SHUFFLE(2, 0, 3, 0))); // x0 x1 x2 x3
+
+    t = _mm_shuffle_ps(b, c, _MM_SHUFFLE(2, 2, 3, 0));               // y1 y2 y3 y3
+    __m128 u = _mm_shuffle_ps(a, t, _MM_SHUFFLE(0, 0, 1, 1));        // y0 y0 y1 y1
+    _mm_storeu_ps(y, _mm_shuffle_ps(u, t, _MM_SHUFFLE(2, 1, 2, 0))); // y0 y1 y2 y3
+
+    t = _mm_shuffle_ps(a, b, _MM_SHUFFLE(1, 1, 2, 2));               // z0 z0 z1 z1
+    _mm_storeu_ps(z, _mm_shuffle_ps(t, c, _MM_SHUFFLE(3, 0, 2, 0))); // z0 z1 z2 z3
+}
+
+__attribute__((target("sse2")))
+static void decodeSse2(const void * frames, int bytesPerAxis, size_t count, float scale,
+                       float * x, float * y, float * z) {
+    const uint8_t * src = (const uint8_t *)frames;
+    __m128 s = _mm_set1_ps(scale);
+    size_t i = 0;
+
+    if (bytesPerAxis == 1) {
+        for (; i + 4 <= count; i += 4) {
+            uint8_t buf[16] = {0};
+            memcpy(buf, &src[3*i], 12);
+            __m128i v = _mm_loadu_si128((const __m128i *)buf);
+            __m128i v0 = _mm_srai_epi16(_mm_unpacklo_epi8(v, v), 8);
+            __m128i v1 = _mm_srai_epi16(_mm_unpackhi_epi8(v, v), 8);
+            sse2Frames4(v0, v1, s, &x[i], &y[i], &z[i]);
+        }
+    } else {
+        for (; i + 4 <= count; i += 4) {
+            __m128i v0 = _mm_loadu_si128((const __m128i *)&src[6*i]);
+            __m128i v1 = _mm_loadl_epi64((const __m128i *)&src[6*i + 16]);
+            sse2Frames4(v0, v1, s, &x[i], &y[i], &z[i]);
+        }
+    }
+
+    decodeScalar(&src[i * 3 * bytesPerAxis], bytesPerAxis, count - i, scale, &x[i], &y[i], &z[i]);
+}
+
+// 8 frames as 24 int32 (a, b, c) to 8 floats per axis
+__attribute__((target("avx2")))
+static inline void avx2Frames8(__m256i a, __m256i b, __m256i c, __m256 scale, float * x, float * y, float * z) {
+    __m256 fa = _mm256_mul_ps(_mm256_cvtepi32_ps(a), scale);
+    __m256 fb = _mm256_mul_ps(_mm256_cvtepi32_ps(b), scale);
+    __m256 fc = _mm256_mul_ps(_mm256_cvtepi32_ps(c), scale);
+
+    // Each axis takes 3, 3 and 2 (or 2, 3, 3) lanes from a, b and c
+    const __m256i xa = _mm256_setr_epi32(0, 3, 6, 0, 0, 0, 0, 0);
+    const __m256i xb = _mm256_setr_epi32(0, 0, 0, 1, 4, 7, 0, 0);
+    const __m256i xc = _mm256_setr_epi32(0, 0, 0, 0, 0, 0, 2, 5);
+    const __m256i ya = _mm256_setr_epi32(1, 4, 7, 0, 0, 0, 0, 0);
+    const __m256i yb = _mm256_setr_epi32(0, 0, 0, 2, 5, 0, 0, 0);
+    const __m256i yc = _mm256_setr_epi32(0, 0, 0, 0, 0, 0, 3, 6);   // Lane 5 is c[0]
+    const __m256i za = _mm256_setr_epi32(2, 5, 0, 0, 0, 0, 0, 0);
+    const __m256i zb = _mm256_setr_epi32(0, 0, 0, 3, 6, 0, 0, 0);
+    const __m256i zc = _mm256_setr_epi32(0, 0, 0, 0, 0, 1, 4, 7);
+
+    __m256 vx = _mm256_blend_ps(_mm256_permutevar8x32_ps(fa, xa), _mm256_permutevar8x32_ps(fb, xb), 0x38);
+    vx = _mm256_blend_ps(vx, _mm256_permutevar8x32_ps(fc, xc), 0xC0);
+    _mm256_storeu_ps(x, vx);
+
+    __m256 vy = _mm256_blend_ps(_mm256_permutevar8x32_ps(fa, ya), _mm256_permutevar8x32_ps(fb, yb), 0x18);
+    vy = _mm256_blend_ps(vy, _mm256_permutevar8x32_ps(fc, yc), 0xE0);
+    _mm256_storeu_ps(y, vy);
+
+    __m256 vz = _mm256_blend_ps(_mm256_permutevar8x32_ps(fa, za), _mm256_permutevar8x32_ps(fb, zb), 0x1C);
+    vz = _mm256_blend_ps(vz, _mm256_permutevar8x32_ps(fc, zc), 0xE0);
+    _mm256_storeu_ps(z, vz);
+}
+
+__attribute__((target("avx2")))
+static void decodeAvx2(const void * frames, int bytesPerAxis, size_t count, float scale,
+                       float * x, float * y, float * z) {
+    const uint8_t * src = (const uint8_t *)frames;
+    __m256 s = _mm256_set1_ps(scale);
+    size_t i = 0;
+
+    if (bytesPerAxis == 1) {
+        for (; i + 8 <= count; i += 8) {
+            const uint8_t * p = &src[3*i];
+            avx2Frames8(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i *)p)),
+                        _mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i *)(p + 8))),
+                        _mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i *)(p + 16))),
+                        s, &x[i], &y[i], &z[i]);
+        }
+    } else {
+        for (; i + 8 <= count; i += 8) {
+            const uint8_t * p = &src[6*i];
+            avx2Frames8(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)p)),
+                        _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(p + 16))),
+                        _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(p + 32))),
+                        s, &x[i], &y[i], &z[i]);
+        }
+    }
+
+    decodeScalar(&src[i * 3 * bytesPerAxis], bytesPerAxis, count - i, scale, &x[i], &y[i], &z[i]);
+}
+
+#endif
+
+bool decoderPathSupported(DecoderPath path) {
+    switch (path) {
+        case DECODER_SCALAR:
+            return true;
+#if defined(DECODER_X86)
+        case DECODER_SSE2:
+            return __builtin_cpu_supports("sse2");
+        case DECODER_AVX2:
+            return __builtin_cpu_supports("avx2");
+#endif
+        default:
+            return false;
+    }
+}
+
+DecoderPath decoderPath() {
+    static int path = -1;
+    if (path < 0) {
+        if (decoderPathSupported(DECODER_AVX2))
+            path = DECODER_AVX2;
+        else if (decoderPathSupported(DECODER_SSE2))
+            path = DECODER_SSE2;
+        else
+            path = DECODER_SCALAR;
+    }
+    return (DecoderPath)path;
+}
+
+const char * decoderPathName(DecoderPath path) {
+    switch (path) {
+        case DECODER_SSE2:   return "sse2";
+        case DECODER_AVX2:   return "avx2";
+        default:             return "scalar";
+    }
+}
+
+void decodeSamplesWith(DecoderPath path, const void * frames, int bytesPerAxis, size_t count,
+                       int accelFactor, float * x, float * y, float * z) {
+    float scale = 1.0f / accelFactor;
+
+    switch (path) {
+#if defined(DECODER_X86)
+        case DECODER_SSE2:
+            decodeSse2(frames, bytesPerAxis, count, scale, x, y, z);
+            break;
+        case DECODER_AVX2:
+            decodeAvx2(frames, bytesPerAxis, count, scale, x, y, z);
+            break;
+#endif
+        default:
+            decodeScalar(frames, bytesPerAxis, count, scale, x, y, z);
+            break;
+    }
+}
+
+void decodeSamples(const void * frames, int bytesPerAxis, size_t count, int accelFactor,
+                   float * x, float * y, float * z) {
+    decodeSamplesWith(decoderPath(), frames, bytesPerAxis, count, accelFactor, x, y, z);
+}
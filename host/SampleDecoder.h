@@ -0,0 +1,48 @@
+/*
+* Copyright 2017 Ingemar Larsson & Lars Gunder Knudsen / empiriKit
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+*/
+
+#ifndef SAMPLE_DECODER_H
+#define SAMPLE_DECODER_H
+
+#include <stddef.h>
+
+// Bulk decoding of packed XYZ accelerometer frames, as the device keeps
+// them in its log (accLog, flash sessions): little endian int16 per axis
+// (14-bit samples), or int8 per axis in fast read mode. Every path gives
+// exactly the same floats, value * (1.0f / accelfactor) in g.
+
+enum DecoderPath {
+    DECODER_SCALAR,
+    DECODER_SSE2,
+    DECODER_AVX2
+};
+
+// The fastest path the CPU supports, checked once
+DecoderPath decoderPath();
+const char * decoderPathName(DecoderPath path);
+bool decoderPathSupported(DecoderPath path);
+
+// bytesPerAxis is 2 or 1 (accSampleBytes() on the device). Output is one
+// float array per axis (structure of arrays); no alignment is required.
+void decodeSamples(const void * frames, int bytesPerAxis, size_t count, int accelFactor,
+                   float * x, float * y, float * z);
+
+// Same with a given path, for benchmarks and checks (must be supported)
+void decodeSamplesWith(DecoderPath path, const void * frames, int bytesPerAxis, size_t count,
+                       int accelFactor, float * x, float * y, float * z);
+
+#endif
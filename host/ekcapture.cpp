@@ -0,0 +1,163 @@
+/*
+* Copyright 2017 Ingemar Larsson & Lars Gunder Knudsen / empiriKit
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <vector>
+
+#include "CaptureFile.h"
+#include "CaptureImport.h"
+#include "SampleDecoder.h"
+
+static const char * usage =
+    "usage: ekcapture import <log.json> <capture.ekc>\n"
+    "       ekcapture info <capture.ekc>\n"
+    "       ekcapture dump <capture.ekc> [tick] [count]\n"
+    "       ekcapture bench [frames]\n";
+
+static int info(const CaptureReader & reader) {
+    const CaptureHeader * header = reader.header();
+    printf("device:       %s\n", header->device);
+    printf("samplingrate: %u\n", header->samplingRate);
+    printf("samples:      %llu\n", (unsigned long long)reader.sampleCount());
+    printf("blocks:       %llu\n", (unsigned long long)reader.blockCount());
+    for (int g = 0; g < reader.groupCount(); g++) {
+        uint64_t first = reader.groupFirstBlock(g);
+        uint64_t end = reader.groupEndBlock(g);
+        printf("group %d:      %llu samples in %llu blocks", g,
+            (unsigned long long)reader.groupSampleCount(g), (unsigned long long)(end - first));
+        if (end > first) {
+            uint64_t last = end - 1;
+            printf(", ticks %llu..%llu", (unsigned long long)reader.blockFirstTick(first),
+                (unsigned long long)(reader.blockFirstTick(last) +
+                    (uint64_t)(reader.blockSamples(last) - 1) * reader.blockTickStep(last)));
+        }
+        printf("\n");
+    }
+    for (uint32_t c = 0; c < header->channelCount; c++)
+        printf("channel %u:    %s (scale %d, group %u)\n", c, reader.channel(c)->name,
+            reader.channel(c)->scale, reader.channel(c)->group);
+    return 0;
+}
+
+// One line per tick: tick, then every channel (empty where a channel has
+// no sample on that tick)
+static int dump(const CaptureReader & reader, uint64_t tick, size_t count) {
+    int channels = reader.header()->channelCount;
+    std::vector<int16_t> values(count * channels);
+    std::vector<uint64_t> ticks(count * channels);
+    std::vector<size_t> n(channels), next(channels, 0);
+
+    for (int c = 0; c < channels; c++)
+        n[c] = reader.read(c, tick, count, &values[c * count], &ticks[c * count]);
+
+    for (size_t line = 0; line < count; line++) {
+        // The lowest tick any channel has left
+        bool any = false;
+        uint64_t t = 0;
+        for (int c = 0; c < channels; c++) {
+            if (next[c] < n[c] && (!any || ticks[c * count + next[c]] < t)) {
+                t = ticks[c * count + next[c]];
+                any = true;
+            }
+        }
+        if (!any)
+            break;
+
+        printf("%llu", (unsigned long long)t);
+        for (int c = 0; c < channels; c++) {
+            if (next[c] < n[c] && ticks[c * count + next[c]] == t)
+                printf(",%d", values[c * count + next[c]++]);
+            else
+                printf(",");
+        }
+        printf("\n");
+    }
+    return 0;
+}
+
+static double seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Decode rate of each path the CPU supports (host/test/test_decoder.cpp
+// checks that they give the same result)
+static int bench(size_t frames) {
+    static const DecoderPath paths[] = { DECODER_SCALAR, DECODER_SSE2, DECODER_AVX2 };
+    std::vector<uint8_t> data(frames * 6);
+    std::vector<float> out(frames * 3);
+
+    srand(1);
+    for (size_t i = 0; i < data.size(); i++)
+        data[i] = rand();
+
+    for (int bytes = 2; bytes >= 1; bytes--) {
+        for (int p = 0; p < 3; p++) {
+            if (!decoderPathSupported(paths[p]))
+                continue;
+            int rounds = 0;
+            double start = seconds();
+            double elapsed;
+            do {
+                decodeSamplesWith(paths[p], &data[0], bytes, frames, 4096,
+                                  &out[0], &out[frames], &out[2 * frames]);
+                rounds++;
+                elapsed = seconds() - start;
+            } while (elapsed < 0.2);
+            printf("%-6s %d bytes per axis: %8.1f Mframes/s%s\n", decoderPathName(paths[p]), bytes,
+                rounds * (double)frames / elapsed * 1e-6, paths[p] == decoderPath() ? " (selected)" : "");
+        }
+    }
+
+    return 0;
+}
+
+int main(int argc, char ** argv) {
+    if (argc >= 4 && strcmp(argv[1], "import") == 0) {
+        int64_t samples = captureImportJson(argv[2], argv[3]);
+        if (samples < 0) {
+            fprintf(stderr, "Import of %s failed\n", argv[2]);
+            return 1;
+        }
+        printf("%lld samples\n", (long long)samples);
+        return 0;
+    }
+
+    if (argc >= 3 && (strcmp(argv[1], "info") == 0 || strcmp(argv[1], "dump") == 0)) {
+        CaptureReader reader;
+        if (!reader.open(argv[2])) {
+            fprintf(stderr, "%s is not a complete capture file\n", argv[2]);
+            return 1;
+        }
+        if (argv[1][0] == 'i')
+            return info(reader);
+        return dump(reader, argc > 3 ? strtoull(argv[3], 0, 10) : 0, argc > 4 ? strtoul(argv[4], 0, 10) : 20);
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "bench") == 0) {
+        size_t frames = argc > 2 ? strtoul(argv[2], 0, 10) : 65536;
+        return bench(frames < 1 ? 1 : frames);
+    }
+
+    fputs(usage, stderr);
+    return 1;
+}
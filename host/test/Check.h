@@ -0,0 +1,37 @@
+/*
+* Copyright 2017 Ingemar Larsson & Lars Gunder Knudsen / empiriKit
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+*/
+
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdio.h>
+
+// Minimal checks for the host tests: failures are printed and counted,
+// the test's main() returns CHECK_RESULT().
+
+static int checkFailures = 0;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            checkFailures++; \
+        } \
+    } while (0)
+
+#define CHECK_RESULT() (printf("%s: %s\n", __FILE__, checkFailures ? "FAILED" : "passed"), checkFailures ? 1 : 0)
+
+#endif
@@ -0,0 +1,27 @@
+#!/bin/sh
+# Builds and runs the host tests of the firmware modules, from the repository root:
+#   sh host/test/run.sh
+set -e
+
+CXX=${CXX:-c++}
+TESTS=
+OUT=${TMPDIR:-/tmp}/empirikit-test
+mkdir -p "$OUT"
+
+build() {
+    name=$1; shift
+    $CXX -O2 -Wall -DTARGET_KL25Z -I. -Ihost/test "$@" -o "$OUT/$name"
+    TESTS="$TESTS $name"
+}
+
+build test_capture -Ihost host/test/test_capture.cpp host/CaptureFile.cpp host/CaptureImport.cpp
+build test_decoder -Ihost host/test/test_decoder.cpp host/SampleDecoder.cpp
+build test_logstore host/test/test_logstore.cpp LogStore.cpp
+build test_orientation host/test/test_orientation.cpp Orientation.cpp
+build test_webusbcdc -Ihost/test/usb host/test/test_webusbcdc.cpp WebUSBCDC.cpp
+
+failed=0
+for t in $TESTS; do
+    "$OUT/$t" || failed=1
+done
+exit $failed
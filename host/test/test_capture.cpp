@@ -0,0 +1,321 @@
+/*
+* Copyright 2017 Ingemar Larsson & Lars Gunder Knudsen / empiriKit
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "CaptureFile.h"
+#include "CaptureImport.h"
+#include "Check.h"
+
+static std::string tempPath(const char * name) {
+    const char * dir = getenv("TMPDIR");
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s.%d", dir ? dir : "/tmp", name, (int)getpid());
+    return path;
+}
+
+static std::vector<uint8_t> readFile(const std::string & path) {
+    std::vector<uint8_t> data;
+    FILE * file = fopen(path.c_str(), "rb");
+    if (!file)
+        return data;
+    int c;
+    while ((c = fgetc(file)) != EOF)
+        data.push_back(c);
+    fclose(file);
+    return data;
+}
+
+static void writeFile(const std::string & path, const void * data, size_t size) {
+    FILE * file = fopen(path.c_str(), "wb");
+    fwrite(data, 1, size, file);
+    fclose(file);
+}
+
+#define TICKS       1000
+#define GAP_START   500     // Messages 500..502 lost
+#define GAP_END     503
+#define MAG_EVERY   5
+#define LIGHT_EVERY 10
+
+static bool captured(int tick) {
+    return tick < GAP_START || tick >= GAP_END;
+}
+
+// A stream as sent by the device: accelerometer on every tick, magnetometer
+// and light sensor on every n-th, a few messages lost and other messages
+// in between
+static void writeMixedStream(const std::string & path) {
+    std::string text = "{\"datatype\":\"Response\",\n\"id\":1,\n\"status\":0}\n";
+    char buf[512];
+    for (int tick = 0; tick < TICKS; tick++) {
+        if (!captured(tick))
+            continue;
+        snprintf(buf, sizeof(buf), "{\"datatype\":\"StreamData\",\n\"samplingrate\":50,\n\"tick\":%d", tick);
+        text += buf;
+        if (tick == GAP_END)
+            text += ",\n\"gap\":3";
+        snprintf(buf, sizeof(buf), ",\n\"accelrange\":2,\n\"accelfactor\":4096,\n\"accelerometerdata\":[%d,%d,%d]",
+            tick, -tick, tick * 30);
+        text += buf;
+        if (tick % MAG_EVERY == 0) {
+            snprintf(buf, sizeof(buf), ",\n\"magnetometerdata\":[%d,%d,%d]", tick / MAG_EVERY, -1, 2);
+            text += buf;
+        }
+        if (tick % LIGHT_EVERY == 0) {
+            snprintf(buf, sizeof(buf), ",\n\"lightsensordata\":%d", 60000 + tick);
+            text += buf;
+        }
+        text += "\n}";
+        if (tick == 700)
+            text += "{\"datatype\":\"Notification\",\"data\":\"Triggered\"}\n";
+    }
+    writeFile(path, text.data(), text.size());
+}
+
+static void testImport(const std::string & jsonPath, const std::string & capturePath) {
+    writeMixedStream(jsonPath);
+    int accCount = TICKS - (GAP_END - GAP_START);
+    int magCount = TICKS / MAG_EVERY - 1;       // 500 lost
+    int lightCount = TICKS / LIGHT_EVERY - 1;   // 500 lost
+    CHECK(captureImportJson(jsonPath.c_str(), capturePath.c_str()) == accCount + magCount + lightCount);
+
+    CaptureReader reader;
+    CHECK(reader.open(capturePath.c_str()));
+    if (!reader.header())
+        return;
+    CHECK(reader.header()->samplingRate == 50);
+    CHECK(reader.groupCount() == 3);
+    CHECK(reader.sampleCount() == (uint64_t)(accCount + magCount + lightCount));
+    CHECK(readFile(capturePath).size() < 16 * 1024);    // No padding of sparse channels or short blocks
+
+    int accX = reader.findChannel("acc.x");
+    int accZ = reader.findChannel("acc.z");
+    int magX = reader.findChannel("mag.x");
+    int light = reader.findChannel("light");
+    CHECK(accX >= 0 && accZ >= 0 && magX >= 0 && light >= 0);
+    CHECK(reader.channel(accX)->scale == 4096 && reader.channel(magX)->scale == 10);
+    CHECK(reader.channel(accX)->group != reader.channel(magX)->group);
+
+    std::vector<int16_t> values(TICKS);
+    std::vector<uint64_t> ticks(TICKS);
+
+    // Every accelerometer sample, with its tick
+    CHECK(reader.read(accZ, 0, TICKS, &values[0], &ticks[0]) == (size_t)accCount);
+    bool ok = true;
+    for (int i = 0, tick = 0; tick < TICKS; tick++) {
+        if (!captured(tick))
+            continue;
+        ok = ok && ticks[i] == (uint64_t)tick && values[i] == (int16_t)(tick * 30);
+        i++;
+    }
+    CHECK(ok);
+
+    CHECK(reader.read(magX, 0, TICKS, &values[0], &ticks[0]) == (size_t)magCount);
+    ok = true;
+    for (int i = 0, tick = 0; tick < TICKS; tick += MAG_EVERY) {
+        if (!captured(tick))
+            continue;
+        ok = ok && ticks[i] == (uint64_t)tick && values[i] == tick / MAG_EVERY;
+        i++;
+    }
+    CHECK(ok);
+
+    CHECK(reader.read(light, 0, TICKS, &values[0], &ticks[0]) == (size_t)lightCount);
+    CHECK(ticks[1] == LIGHT_EVERY && (uint16_t)values[1] == 60000 + LIGHT_EVERY);
+
+    // Reading from a tick between samples starts at the next one
+    CHECK(reader.read(magX, 497, 2, &values[0], &ticks[0]) == 2);
+    CHECK(ticks[0] == 505 && ticks[1] == 510);
+    CHECK(reader.read(magX, 496, 1, &values[0], &ticks[0]) == 1 && ticks[0] == 505);
+    CHECK(reader.read(accX, 501, 1, &values[0], &ticks[0]) == 1 && ticks[0] == 503);
+    CHECK(reader.read(accX, TICKS, 1, &values[0], &ticks[0]) == 0);
+}
+
+// Streams of the firmware before the series have no tick and no accelfactor
+static void testImportPreSeries(const std::string & jsonPath, const std::string & capturePath) {
+    std::string text;
+    char buf[256];
+    for (int i = 0; i < 100; i++) {
+        snprintf(buf, sizeof(buf), "{\"datatype\":\"StreamData\",\n\"samplingrate\":50,\n\"touchsensordata\":%d,\n"
+            "\"accelerometerdata\":[%d,%d,%d]\n}\n", i % 40, i, -i, 1024);
+        text += buf;
+    }
+    writeFile(jsonPath, text.data(), text.size());
+    CHECK(captureImportJson(jsonPath.c_str(), capturePath.c_str()) == 200);
+
+    CaptureReader reader;
+    CHECK(reader.open(capturePath.c_str()));
+    if (!reader.header())
+        return;
+    int accX = reader.findChannel("acc.x");
+    CHECK(accX >= 0 && reader.channel(accX)->scale == 1024);
+    int16_t values[100];
+    uint64_t ticks[100];
+    CHECK(reader.read(accX, 0, 100, values, ticks) == 100);
+    CHECK(ticks[0] == 0 && ticks[99] == 99 && values[99] == 99);
+}
+
+// A range change in the stream ends the import, the samples before it keep their scale
+static void testImportFactorChange(const std::string & jsonPath, const std::string & capturePath) {
+    std::string text;
+    char buf[256];
+    for (int tick = 0; tick < 100; tick++) {
+        snprintf(buf, sizeof(buf), "{\"datatype\":\"StreamData\",\n\"samplingrate\":50,\n\"tick\":%d,\n"
+            "\"accelfactor\":%d,\n\"accelerometerdata\":[%d,0,0]\n}\n", tick, tick < 60 ? 1024 : 4096, tick);
+        text += buf;
+    }
+    writeFile(jsonPath, text.data(), text.size());
+    CHECK(captureImportJson(jsonPath.c_str(), capturePath.c_str()) == 60);
+
+    CaptureReader reader;
+    CHECK(reader.open(capturePath.c_str()));
+    if (!reader.header())
+        return;
+    CHECK(reader.sampleCount() == 60);
+    CHECK(reader.channel(reader.findChannel("acc.x"))->scale == 1024);
+}
+
+// Short blocks: many of them, the last one partial, sizes as written
+static void testBlocks(const std::string & path) {
+    static const char * const names[] = { "a", "b", "c" };
+    const int groups[] = { 0, 0, 1 };
+    CaptureWriter writer;
+    CHECK(writer.open(path.c_str(), 100, 3, names, 0, groups, "test", 16));
+    for (int tick = 0; tick < 100; tick++) {
+        int16_t ab[2] = { (int16_t)tick, (int16_t)(tick + 1) };
+        CHECK(writer.append(tick, ab, 0));
+        if (tick % 3 == 0) {
+            int16_t c = tick;
+            CHECK(writer.append(tick, &c, 1));
+        }
+    }
+    int16_t ab[2] = { 0, 0 };
+    CHECK(!writer.append(99, ab, 0));       // Ticks must increase
+    CHECK(!writer.append(200, ab, 2));      // No such group
+    CHECK(writer.close());
+
+    CaptureReader reader;
+    CHECK(reader.open(path.c_str()));
+    if (!reader.header())
+        return;
+    CHECK(reader.groupEndBlock(0) - reader.groupFirstBlock(0) == 7);  // 6 * 16 + 4
+    CHECK(reader.groupEndBlock(1) - reader.groupFirstBlock(1) == 3);  // 16 + 16 + 2
+    CHECK(reader.groupSampleCount(0) == 100 && reader.groupSampleCount(1) == 34);
+    CHECK(reader.blockSamples(reader.groupEndBlock(0) - 1) == 4);
+    CHECK(reader.blockTickStep(reader.groupFirstBlock(1)) == 3);
+
+    // Header, channels, blocks, index, group table, footer, nothing else
+    uint64_t bytes = sizeof(CaptureHeader) + 3 * sizeof(CaptureChannel) +
+                     6 * (sizeof(CaptureBlockHeader) + 2 * 16 * 2) + (sizeof(CaptureBlockHeader) + 2 * 4 * 2) +
+                     2 * (sizeof(CaptureBlockHeader) + 16 * 2) + (sizeof(CaptureBlockHeader) + 8) +
+                     10 * sizeof(CaptureIndexEntry) + 2 * sizeof(CaptureGroup) + sizeof(CaptureFooter);
+    CHECK(readFile(path).size() == bytes);
+
+    CHECK(reader.blockFirstTick(reader.findBlock(50, 0)) == 48);
+    CHECK(reader.blockFirstTick(reader.findBlock(50, 1)) == 48);
+    CHECK(reader.findBlock(0, 1) == reader.groupFirstBlock(1));
+
+    int16_t values[10];
+    uint64_t ticks[10];
+    CHECK(reader.read(1, 45, 10, values, ticks) == 10);
+    CHECK(ticks[0] == 45 && values[0] == 46 && ticks[9] == 54 && values[9] == 55);
+    CHECK(reader.read(2, 46, 3, values, ticks) == 3);
+    CHECK(ticks[0] == 48 && ticks[1] == 51 && ticks[2] == 54 && values[2] == 54);
+    CHECK(reader.column(0, 2) == 0);       // Not in the block's group
+}
+
+// Damaged files are refused at open, or their damaged blocks read as empty
+static void testDamaged(const std::string & path, const std::string & damagedPath) {
+    std::vector<uint8_t> good = readFile(path);
+    CHECK(good.size() > sizeof(CaptureFooter));
+    if (good.size() <= sizeof(CaptureFooter))
+        return;
+    CaptureFooter footer;
+    memcpy(&footer, &good[good.size() - sizeof(footer)], sizeof(footer));
+    CaptureReader reader;
+    int16_t values[200];
+
+    // Truncated
+    writeFile(damagedPath, &good[0], good.size() - 8);
+    CHECK(!reader.open(damagedPath.c_str()));
+
+    // Index count that doesn't match the file
+    std::vector<uint8_t> data = good;
+    CaptureFooter * f = (CaptureFooter *)&data[data.size() - sizeof(footer)];
+    f->indexCount = 0x1000000000000000ULL;
+    writeFile(damagedPath, &data[0], data.size());
+    CHECK(!reader.open(damagedPath.c_str()));
+
+    // Index offset outside the file
+    data = good;
+    f = (CaptureFooter *)&data[data.size() - sizeof(footer)];
+    f->indexOffset = ~0ULL - 8;
+    writeFile(damagedPath, &data[0], data.size());
+    CHECK(!reader.open(damagedPath.c_str()));
+
+    // Group table pointing past the index
+    data = good;
+    CaptureGroup * table = (CaptureGroup *)&data[data.size() - sizeof(footer) - 2 * sizeof(CaptureGroup)];
+    table[1].firstEntry = footer.indexCount + 1;
+    writeFile(damagedPath, &data[0], data.size());
+    CHECK(!reader.open(damagedPath.c_str()));
+
+    // Channel in a group that doesn't exist
+    data = good;
+    ((CaptureChannel *)&data[sizeof(CaptureHeader)])[2].group = 7;
+    writeFile(damagedPath, &data[0], data.size());
+    CHECK(!reader.open(damagedPath.c_str()));
+
+    // Block offsets into the index or past the end, a block longer than
+    // blockSamples: those blocks are skipped, the others still read
+    data = good;
+    CaptureIndexEntry * index = (CaptureIndexEntry *)&data[footer.indexOffset];
+    index[1].offset = footer.indexOffset - 8;
+    index[2].offset = ~0ULL - 4;
+    ((CaptureBlockHeader *)&data[index[3].offset])->samples = 1000000;
+    writeFile(damagedPath, &data[0], data.size());
+    CHECK(reader.open(damagedPath.c_str()));
+    CHECK(reader.column(1, 0) == 0 && reader.column(2, 0) == 0 && reader.column(3, 0) == 0);
+    CHECK(reader.blockSamples(1) == 0 && reader.blockSamples(3) == 0);
+    CHECK(reader.read(0, 0, 200, values) == 100 - 3 * 16);
+    reader.close();
+
+    unlink(damagedPath.c_str());
+}
+
+int main() {
+    std::string jsonPath = tempPath("test_capture.json");
+    std::string capturePath = tempPath("test_capture.ekc");
+    std::string damagedPath = tempPath("test_capture_damaged.ekc");
+
+    testImport(jsonPath, capturePath);
+    testImportPreSeries(jsonPath, capturePath);
+    testImportFactorChange(jsonPath, capturePath);
+    testBlocks(capturePath);
+    testDamaged(capturePath, damagedPath);
+
+    unlink(jsonPath.c_str());
+    unlink(capturePath.c_str());
+    return CHECK_RESULT();
+}
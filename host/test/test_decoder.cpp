@@ -0,0 +1,103 @@
+/*
+* Copyright 2017 Ingemar Larsson & Lars Gunder Knudsen / empiriKit
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+#include "SampleDecoder.h"
+#include "Check.h"
+
+// Every int16 value appears on each axis, so the frames cover all inputs of
+// both sample sizes (the int8 frames are the same bytes read as int8)
+#define FRAMES  65536
+
+static const DecoderPath paths[] = { DECODER_SCALAR, DECODER_SSE2, DECODER_AVX2 };
+
+static std::vector<uint8_t> data(FRAMES * 6 + 1);
+
+// The scalar path gives value * (1.0f / accelfactor)
+static void testScalar() {
+    std::vector<float> x(FRAMES), y(FRAMES), z(FRAMES);
+    bool ok = true;
+
+    decodeSamplesWith(DECODER_SCALAR, &data[0], 2, FRAMES, 4096, &x[0], &y[0], &z[0]);
+    for (size_t i = 0; i < FRAMES; i++) {
+        int16_t v[3];
+        memcpy(v, &data[i * 6], sizeof(v));
+        ok = ok && x[i] == v[0] * (1.0f / 4096) && y[i] == v[1] * (1.0f / 4096) && z[i] == v[2] * (1.0f / 4096);
+    }
+    CHECK(ok);
+
+    ok = true;
+    decodeSamplesWith(DECODER_SCALAR, &data[0], 1, FRAMES, 64, &x[0], &y[0], &z[0]);
+    for (size_t i = 0; i < FRAMES; i++) {
+        const int8_t * v = (const int8_t *)&data[i * 3];
+        ok = ok && x[i] == v[0] * (1.0f / 64) && y[i] == v[1] * (1.0f / 64) && z[i] == v[2] * (1.0f / 64);
+    }
+    CHECK(ok);
+}
+
+// Every vector path matches the scalar one bit for bit: both sample sizes,
+// counts that leave a tail, unaligned input and output
+static void testPaths() {
+    std::vector<float> ref(FRAMES * 3 + 1), out(FRAMES * 3 + 1);
+
+    for (int p = 1; p < 3; p++) {
+        if (!decoderPathSupported(paths[p])) {
+            printf("%s: not supported by this CPU, not tested\n", decoderPathName(paths[p]));
+            continue;
+        }
+        for (int bytes = 1; bytes <= 2; bytes++) {
+            int factor = bytes == 2 ? 4096 : 64;
+            for (size_t count = 0; count <= 40; count++) {
+                for (int offset = 0; offset <= 1; offset++) {
+                    size_t frames = FRAMES - 40 + count;
+                    ref.assign(ref.size(), 0.0f);
+                    out.assign(out.size(), 0.0f);
+                    decodeSamplesWith(DECODER_SCALAR, &data[offset], bytes, frames, factor,
+                                      &ref[offset], &ref[offset + FRAMES], &ref[offset + 2 * FRAMES]);
+                    decodeSamplesWith(paths[p], &data[offset], bytes, frames, factor,
+                                      &out[offset], &out[offset + FRAMES], &out[offset + 2 * FRAMES]);
+                    if (memcmp(&out[0], &ref[0], out.size() * sizeof(float)) != 0) {
+                        printf("%s: mismatch (%d bytes per axis, %u frames, offset %d)\n",
+                            decoderPathName(paths[p]), bytes, (unsigned int)frames, offset);
+                        CHECK(false);
+                    }
+                }
+            }
+        }
+    }
+}
+
+int main() {
+    // Each axis counts through all int16 values, from a different start
+    for (size_t i = 0; i < FRAMES; i++) {
+        for (int axis = 0; axis < 3; axis++) {
+            uint16_t v = (uint16_t)(i + axis * 21845);
+            data[i * 6 + axis * 2] = v & 0xFF;
+            data[i * 6 + axis * 2 + 1] = v >> 8;
+        }
+    }
+
+    CHECK(decoderPathSupported(DECODER_SCALAR) && decoderPathSupported(decoderPath()));
+    testScalar();
+    testPaths();
+    return CHECK_RESULT();
+}
@@ -0,0 +1,201 @@
+/*
+* Copyright 2017 Ingemar Larsson & Lars Gunder Knudsen / empiriKit
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+*/
+
+#include <string.h>
+
+#include "LogStore.h"
+#include "Check.h"
+
+#define SIM_SECTORS     8
+#define SIM_SECTOR_SIZE 1024
+
+// RAM standing in for the flash. Like the FTFA, erasing sets a whole
+// sector to 0xFF and programming a word that is not erased is an error.
+static uint32_t flash[SIM_SECTORS * SIM_SECTOR_SIZE / 4];
+static int programErrors = 0;
+static int erases = 0;
+static int sectorErases[SIM_SECTORS];
+
+class SimLogStore : public LogStore {
+public:
+    SimLogStore(uintptr_t imageEnd = 0)
+        : LogStore((uintptr_t)flash, SIM_SECTORS, SIM_SECTOR_SIZE), _imageEnd(imageEnd) {}
+
+    bool powerFail;     // Fail all programming (power lost during a save)
+
+protected:
+    virtual bool eraseSector(uintptr_t address) {
+        uintptr_t offset = address - (uintptr_t)flash;
+        if (offset % SIM_SECTOR_SIZE || offset >= sizeof(flash))
+            return false;
+        memset((uint8_t *)flash + offset, 0xFF, SIM_SECTOR_SIZE);
+        erases++;
+        sectorErases[offset / SIM_SECTOR_SIZE]++;
+        return true;
+    }
+
+    virtual bool programWord(uintptr_t address, uint32_t word) {
+        uintptr_t offset = address - (uintptr_t)flash;
+        if (offset % 4 || offset >= sizeof(flash))
+            return false;
+        if (flash[offset / 4] != 0xFFFFFFFF) {
+            programErrors++;
+            return false;
+        }
+        if (powerFail)
+            return false;
+        flash[offset / 4] = word;
+        return true;
+    }
+
+    virtual uintptr_t imageEnd() {
+        return _imageEnd;
+    }
+
+private:
+    uintptr_t _imageEnd;
+};
+
+// Session data: 300 int16 XYZ samples (2 sectors with the header), or
+// 450 (3 sectors)
+#define SAMPLES     300
+#define SAMPLES_3   450
+static int16_t data[SAMPLES_3 * 3];
+
+static void fill(int seed, int samples = SAMPLES) {
+    for (int i = 0; i < samples * 3; i++)
+        data[i] = (int16_t)(seed * 1000 + i);
+}
+
+static bool hasData(SimLogStore & store, uint32_t id, int seed, int samples = SAMPLES) {
+    const LogSessionHeader * h = store.findSession(id);
+    if (!h || h->length != (uint32_t)samples)
+        return false;
+    fill(seed, samples);
+    return memcmp(store.sessionData(h), data, samples * 3 * sizeof(int16_t)) == 0;
+}
+
+// The kept sessions are always the newest ones, in order, with their data
+static bool keepsNewest(SimLogStore & store, uint32_t newest, const int * sizes) {
+    int count = store.sessionCount();
+    for (int i = 0; i < count; i++) {
+        uint32_t id = newest - count + 1 + i;
+        if (store.session(i)->id != id || !hasData(store, id, id, sizes[id]))
+            return false;
+    }
+    return true;
+}
+
+int main() {
+    memset(flash, 0xFF, sizeof(flash));
+
+    SimLogStore store;
+    store.powerFail = false;
+    store.init();
+    CHECK(store.sessionCount() == 0);
+    CHECK(store.freeSectors() == SIM_SECTORS);
+
+    // Four sessions of two sectors fill the store
+    for (int i = 1; i <= 4; i++) {
+        fill(i);
+        CHECK(store.save(data, SAMPLES, 8, 0, 50) == (uint32_t)i);
+    }
+    CHECK(store.sessionCount() == 4);
+    CHECK(store.freeSectors() == 0);
+    CHECK(store.session(0)->samplingRate == 50 && store.session(0)->range == 8);
+
+    // The fifth wraps around and replaces the oldest
+    fill(5);
+    CHECK(store.save(data, SAMPLES, 4, 0, 100) == 5);
+    CHECK(store.sessionCount() == 4);
+    CHECK(store.findSession(1) == 0);
+    CHECK(store.session(0)->id == 2);
+    CHECK(store.session(3)->id == 5);
+    for (int i = 2; i <= 5; i++)
+        CHECK(hasData(store, i, i));
+
+    // Delete
+    CHECK(store.erase(3));
+    CHECK(!store.erase(3));
+    CHECK(store.sessionCount() == 3);
+    CHECK(store.findSession(3) == 0);
+
+    // Reboot: the index is rebuilt from flash, ids continue
+    SimLogStore rebooted;
+    rebooted.powerFail = false;
+    rebooted.init();
+    CHECK(rebooted.sessionCount() == 3);
+    CHECK(rebooted.findSession(3) == 0);
+    CHECK(hasData(rebooted, 2, 2) && hasData(rebooted, 4, 4) && hasData(rebooted, 5, 5));
+    fill(6);
+    CHECK(rebooted.save(data, SAMPLES, 2, 0, 10) == 6);
+    CHECK(rebooted.findSession(2) == 0);    // Its sectors were reused
+    CHECK(hasData(rebooted, 6, 6));
+
+    // Power lost during a save: the session is not listed, its id is not reused
+    rebooted.powerFail = true;
+    fill(7);
+    CHECK(rebooted.save(data, SAMPLES, 2, 0, 10) == 0);
+    rebooted.powerFail = false;
+    SimLogStore afterPowerLoss;
+    afterPowerLoss.powerFail = false;
+    afterPowerLoss.init();
+    CHECK(afterPowerLoss.findSession(7) == 0);
+    CHECK(hasData(afterPowerLoss, 6, 6));
+
+    // Nothing is erased or written when the store overlaps the firmware image
+    SimLogStore overlapped((uintptr_t)flash + SIM_SECTOR_SIZE);
+    overlapped.powerFail = false;
+    overlapped.init();
+    int sessions = overlapped.sessionCount();
+    int erasesBefore = erases;
+    CHECK(!overlapped.writable());
+    CHECK(overlapped.save(data, SAMPLES, 2, 0, 10) == 0);
+    CHECK(!overlapped.erase(overlapped.session(0)->id));
+    CHECK(!overlapped.eraseAll());
+    CHECK(erases == erasesBefore);
+    overlapped.init();
+    CHECK(overlapped.sessionCount() == sessions);
+
+    // Erase all
+    CHECK(afterPowerLoss.eraseAll());
+    CHECK(afterPowerLoss.sessionCount() == 0);
+    CHECK(afterPowerLoss.freeSectors() == SIM_SECTORS);
+
+    // Mixed sizes, 3/3/2/3/3/3/3 sectors: a session that doesn't fit before
+    // the end evicts the sessions left there before those at the start
+    static const int sizes[8] = { 0, SAMPLES_3, SAMPLES_3, SAMPLES, SAMPLES_3, SAMPLES_3, SAMPLES_3, SAMPLES_3 };
+    static const int kept[8] = { 0, 1, 2, 3, 3, 3, 2, 2 };
+    memset(flash, 0xFF, sizeof(flash));
+    memset(sectorErases, 0, sizeof(sectorErases));
+    SimLogStore mixed;
+    mixed.powerFail = false;
+    mixed.init();
+    for (int i = 1; i <= 7; i++) {
+        fill(i, sizes[i]);
+        CHECK(mixed.save(data, sizes[i], 2, 0, 10) == (uint32_t)i);
+        CHECK(mixed.sessionCount() == kept[i]);
+        CHECK(keepsNewest(mixed, i, sizes));
+    }
+    CHECK(mixed.freeSectors() == 2);
+    // Every sector was reused, the tail of the first pass too: wear is even
+    for (int sector = 0; sector < SIM_SECTORS; sector++)
+        CHECK(sectorErases[sector] >= 1 && sectorErases[sector] <= 2);
+
+    CHECK(programErrors == 0);
+    return CHECK_RESULT();
+}
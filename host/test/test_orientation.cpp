@@ -0,0 +1,105 @@
+/*
+* Copyright 2017 Ingemar Larsson & Lars Gunder Knudsen / empiriKit
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+*/
+
+#include <math.h>
+#include <stdlib.h>
+
+#include "Orientation.h"
+#include "Check.h"
+
+static double maxAngleError = 0;
+static double maxMagnitudeError = 0;
+
+static double degrees(double radians) {
+    return radians * 18000.0 / M_PI;
+}
+
+// Difference of two angles in centidegrees, across the +-180 degree seam
+static double angleError(double a, double b) {
+    double d = fabs(a - b);
+    return d > 18000.0 ? 36000.0 - d : d;
+}
+
+static void compare(int x, int y, int z) {
+    int16_t xyz[3] = { (int16_t)x, (int16_t)y, (int16_t)z };
+    Orientation o;
+    computeOrientation(xyz, &o);
+
+    double yz = sqrt((double)y*y + (double)z*z);
+    double magnitude = sqrt((double)x*x + yz*yz);
+    if (!o.valid) {
+        CHECK(magnitude < ORIENTATION_MIN_MAGNITUDE + 1);
+        CHECK(o.pitch == 0 && o.roll == 0);
+        return;
+    }
+
+    double pitchError = angleError(o.pitch, degrees(atan2(-x, yz)));
+    double rollError = angleError(o.roll, degrees(atan2(y, z)));
+    double magnitudeError = fabs(o.magnitude - magnitude);
+    CHECK(o.pitch >= -9000 && o.pitch <= 9000);
+    CHECK(o.roll >= -18000 && o.roll <= 18000);
+
+    if (pitchError > maxAngleError)
+        maxAngleError = pitchError;
+    if (rollError > maxAngleError)
+        maxAngleError = rollError;
+    if (magnitudeError > maxMagnitudeError)
+        maxMagnitudeError = magnitudeError;
+}
+
+int main() {
+    // No direction
+    int16_t zero[3] = { 0, 0, 0 };
+    Orientation o;
+    computeOrientation(zero, &o);
+    CHECK(!o.valid && o.pitch == 0 && o.roll == 0 && o.magnitude == 0);
+
+    int32_t m;
+    CHECK(cordicAtan2(0, 0, &m) == 0 && m == 0);
+    CHECK(cordicAtan2(0, 100, &m) == 0 && m == 100);
+    CHECK(cordicAtan2(100, 0, &m) == 9000 && m == 100);
+    CHECK(cordicAtan2(-100, 0, 0) == -9000);
+    CHECK(abs(cordicAtan2(0, -100, 0)) == 18000);
+
+    // Along the axes, with y = z = 0 the roll is 0
+    int16_t down[3] = { 0, 0, 4096 };
+    computeOrientation(down, &o);
+    CHECK(o.valid && o.pitch == 0 && o.roll == 0 && o.magnitude == 4096);
+    int16_t nose[3] = { -4096, 0, 0 };
+    computeOrientation(nose, &o);
+    CHECK(o.valid && o.pitch == 9000 && o.roll == 0 && o.magnitude == 4096);
+
+    // Small vectors, the extremes and a random sample of the int16 range
+    for (int x = -4; x <= 4; x++)
+        for (int y = -4; y <= 4; y++)
+            for (int z = -4; z <= 4; z++)
+                compare(x, y, z);
+    for (int x = -32768; x <= 32767; x += 32767)
+        for (int y = -32768; y <= 32767; y += 32767)
+            for (int z = -32768; z <= 32767; z += 32767)
+                compare(x, y, z);
+    srand(1);
+    for (int i = 0; i < 1000000; i++) {
+        int shift = rand() % 16;    // Sample all magnitudes, not mostly the large ones
+        compare((int16_t)rand() >> shift, (int16_t)rand() >> shift, (int16_t)rand() >> shift);
+    }
+
+    printf("max error: %.2f centidegrees, %.2f counts\n", maxAngleError, maxMagnitudeError);
+    CHECK(maxAngleError <= 1.0);
+    CHECK(maxMagnitudeError <= 3.0);
+    return CHECK_RESULT();
+}
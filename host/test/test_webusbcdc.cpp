@@ -0,0 +1,170 @@
+/*
+* Copyright 2017 Ingemar Larsson & Lars Gunder Knudsen / empiriKit
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "WebUSBCDC.h"
+#include "Trace.h"
+#include "Check.h"
+
+uint32_t simTimeUs = 0;
+
+void traceEvent(uint16_t, uint16_t, uint32_t) {}
+
+#define WEBUSB_IN   EP5IN
+#define CDC_IN      EPBULK_IN
+#define CLS_DTR     (1 << 0)
+
+class TestCDC : public WebUSBCDC {
+public:
+    TestCDC() : WebUSBCDC(0x1209, 0x0001) {}
+
+    void setLineState(int state) {
+        memset(&transfer, 0, sizeof(transfer));
+        transfer.setup.bmRequestType.Type = CLASS_TYPE;
+        transfer.setup.bmRequestType.Recipient = INTERFACE_RECIPIENT;
+        transfer.setup.bRequest = 0x22;     // CDC_SET_CONTROL_LINE_STATE
+        transfer.setup.wValue = state;
+        USBCallback_request();
+    }
+};
+
+static uint8_t packet[MAX_PACKET_SIZE_EPBULK];
+
+static uint8_t * fill(int n, bool isCDC) {
+    for (int i = 0; i < (int)sizeof(packet); i++)
+        packet[i] = (uint8_t)(n * 7 + i + (isCDC ? 128 : 0));
+    return packet;
+}
+
+static bool inOrder(const std::vector<WebUSBDevice::Packet> & received, int count, bool isCDC) {
+    if ((int)received.size() != count)
+        return false;
+    for (int n = 0; n < count; n++) {
+        if (received[n].size() != sizeof(packet) || memcmp(&received[n][0], fill(n, isCDC), sizeof(packet)) != 0)
+            return false;
+    }
+    return true;
+}
+
+// Writes packets that take prepareUs each to build, returns the time taken
+static uint32_t stream(TestCDC & usb, int count, uint32_t prepareUs) {
+    uint32_t start = simTimeUs;
+    for (int n = 0; n < count; n++) {
+        simTimeUs += prepareUs;
+        CHECK(usb.write(fill(n, false), sizeof(packet)));
+    }
+    while (!usb.writeReady())
+        ;
+    return simTimeUs - start;
+}
+
+#define PACKETS     200
+#define HOST_US     1000    // One packet per frame
+
+int main() {
+    // Packets are taken in order, none is overwritten while the host holds it
+    {
+        TestCDC usb;
+        usb.hostIntervalUs = HOST_US;
+        stream(usb, PACKETS, 0);
+        CHECK(inOrder(usb.received[WEBUSB_IN], PACKETS, false));
+        CHECK(usb.overwrites == 0);
+    }
+
+    // Preparing the next packet overlaps with the host taking the previous
+    // one: the time is set by the host, not by the sum of both
+    {
+        TestCDC usb;
+        usb.hostIntervalUs = HOST_US;
+        uint32_t elapsed = stream(usb, PACKETS, 800);
+        printf("sustained %u bytes/s (host limit %u, without overlap %u)\n",
+            (unsigned int)((uint64_t)PACKETS * sizeof(packet) * 1000000 / elapsed),
+            (unsigned int)(sizeof(packet) * 1000000 / HOST_US),
+            (unsigned int)(sizeof(packet) * 1000000 / (HOST_US + 800)));
+        CHECK(elapsed < PACKETS * HOST_US + 2 * HOST_US);
+        CHECK(elapsed >= (PACKETS - 1) * HOST_US);
+        CHECK(usb.writeStalledUs() < PACKETS * 250);
+        CHECK(inOrder(usb.received[WEBUSB_IN], PACKETS, false));
+        CHECK(usb.overwrites == 0);
+    }
+
+    // When preparing takes longer than the host, writes never wait
+    {
+        TestCDC usb;
+        usb.hostIntervalUs = HOST_US;
+        stream(usb, PACKETS, 1200);
+        CHECK(usb.writeStalledUs() < PACKETS * 10);
+        CHECK(inOrder(usb.received[WEBUSB_IN], PACKETS, false));
+    }
+
+    // WebUSB and CDC endpoints interleaved, each keeps its own order
+    {
+        TestCDC usb;
+        usb.hostIntervalUs = HOST_US;
+        CHECK(!usb.write(fill(0, true), sizeof(packet), true));     // No terminal yet
+        usb.setLineState(CLS_DTR);
+        for (int n = 0; n < PACKETS; n++) {
+            CHECK(usb.write(fill(n, false), sizeof(packet)));
+            CHECK(usb.write(fill(n, true), sizeof(packet), true));
+        }
+        while (!usb.writeReady() || !usb.writeReady(true))
+            ;
+        CHECK(inOrder(usb.received[WEBUSB_IN], PACKETS, false));
+        CHECK(inOrder(usb.received[CDC_IN], PACKETS, true));
+        CHECK(usb.overwrites == 0);
+        usb.setLineState(0);
+        CHECK(!usb.writeReady(true));
+    }
+
+    // A stalled host: the write times out, the queued packet is kept and
+    // sent once the host is back, the abandoned one is not
+    {
+        TestCDC usb;
+        usb.hostIntervalUs = HOST_US;
+        usb.hostStalled = true;
+        usb.setWriteTimeout(5000);
+        CHECK(usb.write(fill(0, false), sizeof(packet)));
+        CHECK(!usb.writeReady());
+        uint32_t start = simTimeUs;
+        CHECK(!usb.write(fill(1, false), sizeof(packet)));
+        CHECK(simTimeUs - start >= 5000);
+        CHECK(usb.writeStalledUs() >= 5000);
+        usb.hostStalled = false;
+        while (!usb.writeReady())
+            ;
+        CHECK(usb.write(fill(1, false), sizeof(packet)));
+        while (!usb.writeReady())
+            ;
+        CHECK(inOrder(usb.received[WEBUSB_IN], 2, false));
+        CHECK(usb.overwrites == 0);
+    }
+
+    // Too large or unconfigured writes are refused
+    {
+        TestCDC usb;
+        uint8_t large[MAX_PACKET_SIZE_EPBULK + 1];
+        CHECK(!usb.write(large, sizeof(large)));
+        usb.isConfigured = false;
+        CHECK(!usb.write(fill(0, false), sizeof(packet)));
+        CHECK(!usb.writeReady());
+        CHECK(usb.received[WEBUSB_IN].empty());
+    }
+
+    return CHECK_RESULT();
+}
@@ -0,0 +1,45 @@
+/*
+* Copyright 2017 Ingemar Larsson & Lars Gunder Knudsen / empiriKit
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+*/
+
+// Descriptor constants from the mbed USBDevice library, for the host tests
+
+#ifndef USBDESCRIPTOR_H
+#define USBDESCRIPTOR_H
+
+#define STRING_DESCRIPTOR           (3)
+#define CONFIGURATION_DESCRIPTOR    (2)
+#define INTERFACE_DESCRIPTOR        (4)
+#define ENDPOINT_DESCRIPTOR         (5)
+
+#define CONFIGURATION_DESCRIPTOR_LENGTH (0x09)
+#define INTERFACE_DESCRIPTOR_LENGTH     (0x09)
+#define ENDPOINT_DESCRIPTOR_LENGTH      (0x07)
+
+#define C_RESERVED      (1U<<7)
+#define C_POWER(mA)     ((mA)/2)
+
+#define E_CONTROL       (0x00)
+#define E_BULK          (0x02)
+#define E_INTERRUPT     (0x03)
+
+#define LSB(n)  ((n) & 0xff)
+#define MSB(n)  (((n) & 0xff00) >> 8)
+
+#define DESCRIPTOR_TYPE(wValue)     ((wValue) >> 8)
+#define DESCRIPTOR_INDEX(wValue)    ((wValue) & 0xff)
+
+#endif
@@ -0,0 +1,78 @@
+/*
+* Copyright 2017 Ingemar Larsson & Lars Gunder Knudsen / empiriKit
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+*/
+
+// The parts of the mbed USBDevice HAL used by WebUSBCDC, for the host tests
+
+#ifndef USBHAL_H
+#define USBHAL_H
+
+#include <stdint.h>
+
+typedef enum {
+    EP_COMPLETED,
+    EP_PENDING,
+    EP_INVALID,
+    EP_STALLED,
+} EP_STATUS;
+
+// Physical endpoints as in USBEndpoints_KL25Z.h
+#define EPINT_IN    (3)
+#define EPBULK_OUT  (4)
+#define EPBULK_IN   (5)
+#define EP5OUT      (10)
+#define EP5IN       (11)
+#define NUMBER_OF_PHYSICAL_ENDPOINTS (32)
+
+#define MAX_PACKET_SIZE_EPINT   (64)
+#define MAX_PACKET_SIZE_EPBULK  (64)
+
+#define PHY_TO_DESC(endpoint) (((endpoint) >> 1) | (((endpoint) & 1) ? 0x80 : 0))
+
+#define STANDARD_TYPE       (0)
+#define CLASS_TYPE          (1)
+#define VENDOR_TYPE         (2)
+
+#define DEVICE_RECIPIENT    (0)
+#define INTERFACE_RECIPIENT (1)
+
+#define HOST_TO_DEVICE      (0)
+#define DEVICE_TO_HOST      (1)
+
+#define GET_DESCRIPTOR      (6)
+
+struct SETUP_PACKET {
+    struct {
+        uint8_t dataTransferDirection;
+        uint8_t Type;
+        uint8_t Recipient;
+    } bmRequestType;
+    uint8_t bRequest;
+    uint16_t wValue;
+    uint16_t wIndex;
+    uint16_t wLength;
+};
+
+struct CONTROL_TRANSFER {
+    SETUP_PACKET setup;
+    uint8_t * ptr;
+    uint32_t remaining;
+    uint8_t direction;
+    bool zlp;
+    bool notify;
+};
+
+#endif
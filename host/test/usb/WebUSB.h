@@ -0,0 +1,38 @@
+/*
+* Copyright 2017 Ingemar Larsson & Lars Gunder Knudsen / empiriKit
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+*/
+
+// WebUSB descriptor constants, for the host tests
+
+#ifndef WEBUSB_H
+#define WEBUSB_H
+
+#define WEBUSB_DESCRIPTOR_SET_HEADER        (0)
+#define WEBUSB_CONFIGURATION_SUBSET_HEADER  (1)
+#define WEBUSB_FUNCTION_SUBSET_HEADER       (2)
+#define WEBUSB_URL                          (3)
+
+#define WEBUSB_DESCRIPTOR_SET_LENGTH        (5)
+#define WEBUSB_CONFIGURATION_SUBSET_LENGTH  (4)
+#define WEBUSB_FUNCTION_SUBSET_LENGTH       (3)
+
+#define WEBUSB_URL_SCHEME_HTTP              (0)
+#define WEBUSB_URL_SCHEME_HTTPS             (1)
+
+#define URL_OFFSET_LANDING_PAGE             (1)
+#define URL_OFFSET_ALLOWED_ORIGIN           (2)
+
+#endif
@@ -0,0 +1,132 @@
+/*
+* Copyright 2017 Ingemar Larsson & Lars Gunder Knudsen / empiriKit
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+*/
+
+// Simulated USB device controller and host for the host tests of WebUSBCDC.
+//
+// Like the KL25Z USBHAL, one IN packet per endpoint is held by the
+// controller: endpointWrite() hands it over and endpointWriteResult()
+// reports EP_COMPLETED once (the flag is cleared when read) after the
+// host has taken it. The host takes one packet at a time, each taking
+// hostIntervalUs of the simulated clock (see us_ticker_api.h), and keeps
+// them in order per endpoint. Writing a packet while the previous one is
+// still held would overwrite it on the device, that is counted in
+// overwrites.
+
+#ifndef WEB_USB_DEVICE_H
+#define WEB_USB_DEVICE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#include "USBHAL.h"
+#include "us_ticker_api.h"
+
+class USBDevice {
+public:
+    bool readEP(uint8_t, uint8_t *, uint32_t * size, uint32_t) { *size = 0; return true; }
+    bool readEP_NB(uint8_t, uint8_t *, uint32_t * size, uint32_t) { *size = 0; return false; }
+};
+
+class WebUSBDevice : public USBDevice {
+public:
+    typedef std::vector<uint8_t> Packet;
+
+    WebUSBDevice(uint16_t, uint16_t, uint16_t) {
+        memset(&transfer, 0, sizeof(transfer));
+        memset(held, 0, sizeof(held));
+        memset(complete, 0, sizeof(complete));
+        memset(takeAt, 0, sizeof(takeAt));
+        isConfigured = true;
+        hostStalled = false;
+        hostIntervalUs = 0;
+        hostLastTakeUs = 0;
+        overwrites = 0;
+    }
+
+    bool configured() { return isConfigured; }
+
+    // Simulated host
+    bool isConfigured;
+    bool hostStalled;               // The host takes no packets
+    uint32_t hostIntervalUs;        // Time the host needs per packet
+    std::vector<Packet> received[NUMBER_OF_PHYSICAL_ENDPOINTS];
+    int overwrites;
+
+    // Control request as sent by the host, then call USBCallback_request()
+    CONTROL_TRANSFER transfer;
+
+protected:
+    void connect() {}
+    CONTROL_TRANSFER * getTransferPtr() { return &transfer; }
+
+    bool addEndpoint(uint8_t, uint32_t) { return true; }
+    bool readStart(uint8_t, uint32_t) { return true; }
+
+    EP_STATUS endpointWrite(uint8_t endpoint, uint8_t * data, uint32_t size) {
+        hostPoll(endpoint);
+        if (held[endpoint])
+            overwrites++;
+        packet[endpoint].assign(data, data + size);
+        held[endpoint] = true;
+        complete[endpoint] = false;
+        uint32_t now = simTimeUs;
+        takeAt[endpoint] = ((int32_t)(now - hostLastTakeUs) > 0 ? now : hostLastTakeUs) + hostIntervalUs;
+        return EP_PENDING;
+    }
+
+    EP_STATUS endpointWriteResult(uint8_t endpoint) {
+        hostPoll(endpoint);
+        if (complete[endpoint]) {
+            complete[endpoint] = false;
+            return EP_COMPLETED;
+        }
+        return EP_PENDING;
+    }
+
+    virtual bool USBCallback_request() { return false; }
+    virtual bool USBCallback_setConfiguration(uint8_t) { return false; }
+    virtual uint8_t * stringIproductDesc() { return 0; }
+    virtual uint8_t * stringIinterfaceDesc() { return 0; }
+    virtual uint8_t * configurationDesc() { return 0; }
+    virtual uint8_t * stringImanufacturerDesc() { return 0; }
+    virtual uint8_t * stringIserialDesc() { return 0; }
+    virtual uint8_t * allowedOriginsDesc() { return 0; }
+    virtual uint8_t * urlIlandingPage() { return 0; }
+    virtual uint8_t * urlIallowedOrigin() { return 0; }
+    virtual void SOF(int) {}
+
+private:
+    // Every HAL call takes 1 us, so polling loops make progress
+    void hostPoll(uint8_t endpoint) {
+        simTimeUs++;
+        if (!held[endpoint] || hostStalled || (int32_t)(simTimeUs - takeAt[endpoint]) < 0)
+            return;
+        received[endpoint].push_back(packet[endpoint]);
+        hostLastTakeUs = takeAt[endpoint];
+        held[endpoint] = false;
+        complete[endpoint] = true;
+    }
+
+    Packet packet[NUMBER_OF_PHYSICAL_ENDPOINTS];
+    bool held[NUMBER_OF_PHYSICAL_ENDPOINTS];
+    bool complete[NUMBER_OF_PHYSICAL_ENDPOINTS];
+    uint32_t takeAt[NUMBER_OF_PHYSICAL_ENDPOINTS];
+    uint32_t hostLastTakeUs;
+};
+
+#endif
@@ -0,0 +1,28 @@
+/*
+* Copyright 2017 Ingemar Larsson & Lars Gunder Knudsen / empiriKit
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+*/
+
+// Microsoft OS descriptor constants, for the host tests
+
+#ifndef WINUSB_H
+#define WINUSB_H
+
+#define WINUSB_VENDOR_CODE                                      (0x20)
+#define WINUSB_GET_COMPATIBLE_ID_FEATURE_DESCRIPTOR             (0x0004)
+#define WINUSB_GET_EXTENDED_PROPERTIES_OS_FEATURE_DESCRIPTOR    (0x0005)
+#define COMPATIBLE_ID_VERSION_1_0                               (0x0100)
+
+#endif
@@ -0,0 +1,32 @@
+/*
+* Copyright 2017 Ingemar Larsson & Lars Gunder Knudsen / empiriKit
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+*/
+
+// Simulated us ticker of the host tests: every read advances the clock by
+// 1 us, so polling loops make progress. Tests move it with simTimeUs.
+
+#ifndef US_TICKER_API_H
+#define US_TICKER_API_H
+
+#include <stdint.h>
+
+extern uint32_t simTimeUs;
+
+inline uint32_t us_ticker_read() {
+    return simTimeUs++;
+}
+
+#endif
@@ -17,9 +17,11 @@
 
 
 #include "mbed.h"
+#include "us_ticker_api.h"
 
 #include "empirikit.h"
 #include "WebUSBCDC.h"
+#include "LogStore.h"
 
 #if defined(TARGET_KL46Z)
 #include "SLCD.h"
@@ -40,44 +42,168 @@ void setRGB(uint8_t r, uint8_t g, uint8_t b) {
 }
 #endif
 
-void setStreamSamplingRate(int rate) {
+bool setStreamSamplingRate(int rate) {
     if (rate < 1 || rate > 100)
-        return;
+        return false;
 
     _stream_sampling_rate = rate;
     _stream_sampling_wait_us = (1000000 / rate);
+    return true;
 }
 
 // Communication
 WebUSBCDC webUSB(0x1209, 0x0001, 0x0001, true);
 
-uint8_t* rbuf;
+// Sampling period in local us, corrected so the rate tracks the host's clock.
+// The fraction of a us is carried over so it doesn't drift either.
+int samplingPeriodUs() {
+    if (!webUSB.sofLocked())
+        return _stream_sampling_wait_us;
+
+    samplePhase += (int64_t)_stream_sampling_wait_us * webUSB.sofDrift();
+    int32_t correction = samplePhase / (1000000 * 256);
+    samplePhase -= (int64_t)correction * 1000000 * 256;
+    return _stream_sampling_wait_us + correction;
+}
+
+void startSampleClock() {
+    sampleDeadline = us_ticker_read();
+    samplePhase = 0;
+}
+
+// Busy wait for the next sampling period. Returns the number of whole
+// periods that passed without a sample (e.g. blocked on USB), they are
+// skipped so the clock keeps its phase.
+int waitForNextSample() {
+    int period = samplingPeriodUs();
+    int missed = 0;
+
+    sampleDeadline += period;
+
+    int32_t late = us_ticker_read() - sampleDeadline;
+    if (late > period) {
+        missed = late / period;
+        sampleDeadline += missed * period;
+    }
+
+    while ((int32_t)(us_ticker_read() - sampleDeadline) < 0);
+    return missed;
+}
+
+uint8_t* rbuf = arena.rbuf;
 uint32_t rbuf_len = 0;
 uint32_t read_size;
 
-uint8_t* rbuf_cdc;
-uint32_t rbuf_len_cdc = 0;
-uint32_t read_size_cdc;
+char* sbuf = arena.sbuf;
 
-char* sbuf;
 
-
-void sendString(const char* str, bool isCDC=false) {
-    int len = strlen(str);
+// Returns the number of bytes handed to USB, less than len if not
+// connected or the write timed out
+int sendBytes(const char* data, int len) {
+    int sent = 0;
     uint32_t byte_count;
-    uint8_t* byte_ptr = (uint8_t*)str;
 
-    while(len>0) {
-        byte_count = MIN(MAX_PACKET_SIZE_EPBULK, len);
-        webUSB.write(byte_ptr, byte_count);
-        len-=MAX_PACKET_SIZE_EPBULK;
-        byte_ptr+=byte_count;
+    while (sent < len) {
+        byte_count = MIN(MAX_PACKET_SIZE_EPBULK, len - sent);
+        if (!webUSB.write((uint8_t*)data + sent, byte_count))
+            break;
+        sent += byte_count;
+    }
+    return sent;
+}
+
+// With a drop policy no write from the main loop may wait for the host
+// longer than STREAM_WRITE_TIMEOUT_US, replies and notifications included
+void applyWriteTimeout() {
+    webUSB.setWriteTimeout(overloadPolicy == OVERLOAD_BLOCK ? 0 : STREAM_WRITE_TIMEOUT_US);
+}
+
+// Finish a message cut short, false if it still isn't complete
+bool sendStreamPending() {
+    if (streamPendingLength > 0 && !webUSB.configured())
+        streamPendingLength = 0;    // A new connection starts with a new message
+
+    int sent = sendBytes(streamPending, streamPendingLength);
+    streamPending += sent;
+    streamPendingLength -= sent;
+    return streamPendingLength == 0;
+}
+
+// Messages are sent in pieces. With a drop policy a message whose first
+// piece can't be sent is dropped as a whole, and the rest of a piece cut
+// short is kept like that of a stream message. A host that stops reading
+// in the middle of a long reply (GETLOG) gets it cut short.
+bool sendString(const char* str, bool isCDC=false) {
+    if (strncmp(str, "{\"datatype\"", 11) == 0)
+        sendDropping = false;   // A new message
+    if (sendDropping || !sendStreamPending()) {
+        sendDropping = true;
+        return false;
+    }
+
+    int len = strlen(str);
+    int sent = sendBytes(str, len);
+    if (sent < len) {
+        if (sent == 0 || len - sent > STREAM_MSG_SIZE) {
+            sendDropping = true;
+            return false;
+        }
+        memcpy(arena.streamMsg, str + sent, len - sent);
+        streamPending = arena.streamMsg;
+        streamPendingLength = len - sent;
     }
+    return true;
+}
+
+// Start a message, with the id of the command being handled (if any)
+void sendDatatype(const char* datatype) {
+    if (commandId >= 0)
+        sprintf(sbuf, "{\"datatype\":\"%s\",\n\"id\":%d,\n", datatype, commandId);
+    else
+        sprintf(sbuf, "{\"datatype\":\"%s\",\n", datatype);
+    sendString(sbuf);
+}
+
+// Sampling clock vs. host (USB SOF) in ppm, positive = device clock fast
+void sendClockDrift() {
+    int32_t drift = webUSB.sofDrift();
+    int32_t driftAbs = (drift < 0) ? -drift : drift;
+    sprintf(sbuf,"\"clocklocked\":%d,\n\"clockdriftppm\":%s%d.%02d,\n",
+        webUSB.sofLocked() ? 1 : 0, (drift < 0) ? "-" : "",
+        (int)(driftAbs >> 8), (int)((driftAbs & 0xFF) * 100 >> 8));
+    sendString(sbuf);
+}
+
+void sendStatistics() {
+    sendDatatype("Statistics");
+    sendClockDrift();
+    sprintf(sbuf, "\"overloadpolicy\":%d,\n\"samplingrate\":%d,\n\"requestedrate\":%d,\n\"samples\":%u,\n\"dropped\":%u,\n\"stalledus\":%u}\n",
+        overloadPolicy, _stream_sampling_rate, streamRequestedRate, (unsigned int)streamSeq,
+        (unsigned int)streamDropped, (unsigned int)webUSB.writeStalledUs());
+    sendString(sbuf);
+}
+
+// End of the static data (.data, .bss), where the heap starts, and the top
+// of the stack (the initial stack pointer)
+#if defined(__CC_ARM)
+extern char Image$$RW_IRAM1$$ZI$$Limit[];
+extern const uint32_t __Vectors[];  // Startup file, the first entry is the initial stack pointer
+#define RAM_STATIC_END  ((uint32_t)(uintptr_t)Image$$RW_IRAM1$$ZI$$Limit)
+#define RAM_STACK_TOP   (__Vectors[0])
+#else
+extern char __end__[], __StackTop[];    // GCC_ARM linker script
+#define RAM_STATIC_END  ((uint32_t)(uintptr_t)__end__)
+#define RAM_STACK_TOP   ((uint32_t)(uintptr_t)__StackTop)
+#endif
+
+// RAM between the static data and the top of the stack, shared by the heap and the stack
+uint32_t ramFree() {
+    return RAM_STACK_TOP - RAM_STATIC_END;
 }
 
 void sendHardwareInformation() {
 
-    sendString("{\"datatype\":\"HardwareInfo\",\n");
+    sendDatatype("HardwareInfo");
 #if defined(TARGET_KL25Z)
     sendString("\"devicetype\":\"empiriKit|MOTION\",\n");
 #elif defined(TARGET_KL46Z)
@@ -89,6 +215,9 @@ void sendHardwareInformation() {
         *((unsigned int *)0x4004805C),
         *((unsigned int *)0x40048060));
     sendString(sbuf);
+    sprintf(sbuf,"\"arenasize\":%d,\n\"ramfree\":%u,\n", (int)sizeof(Arena), (unsigned int)ramFree());
+    sendString(sbuf);
+    sendClockDrift();
     sendString("\"capabilities\":[\n");
     sendString("\"accelerometer\",\n");
 #if defined(TARGET_KL25Z)
@@ -101,52 +230,544 @@ void sendHardwareInformation() {
     sendString("]}");
 }
 
+// Persistent sessions in the upper part of the internal flash
+LogStore logStore(LOG_STORE_BASE, LOG_STORE_SECTORS, FLASH_SECTOR_SIZE);
+
+// Send XYZ samples (int16_t, or int8_t when fastRead) as an AccelerometerLog
+void sendAccLog(const void* data, int length, int range, int fastRead, int samplingRate, uint32_t session, int preTrigger) {
+    sendDatatype("AccelerometerLog");
+    sprintf(sbuf, "\"session\":%u,\n" \
+                 "\"accelrange\":%d,\n" \
+                 "\"accelfactor\":%d,\n" \
+                 "\"samplingrate\":%d,\n", (unsigned int)session, range, accFactor(range, fastRead), samplingRate);
+    sendString(sbuf);
+    if (preTrigger >= 0) {
+        sprintf(sbuf, "\"pretrigger\":%d,\n", preTrigger);
+        sendString(sbuf);
+    }
+    sendString("\"data\":[\n");
+    for (int i=0; i<length*3; i=i+3) {
+        if (fastRead) {
+            const int8_t *log8 = (const int8_t*)data;
+            accXYZ[0] = log8[i];
+            accXYZ[1] = log8[i+1];
+            accXYZ[2] = log8[i+2];
+        } else {
+            const int16_t *log16 = (const int16_t*)data;
+            accXYZ[0] = log16[i];
+            accXYZ[1] = log16[i+1];
+            accXYZ[2] = log16[i+2];
+        }
+        if (i<(length*3-3))
+            sprintf(sbuf,"[%d,%d,%d],\n",accXYZ[0],accXYZ[1],accXYZ[2]);
+        else
+            sprintf(sbuf,"[%d,%d,%d]\n",accXYZ[0],accXYZ[1],accXYZ[2]);
+        sendString(sbuf);
+    }
+    sendString("]}\n");
+}
+
+#if defined(TARGET_KL46Z)
+// Magnetometer and light sensor samples logged alongside the accelerometer.
+// Sample n was taken at accelerometer sample n * divider. Each log stops
+// when it is full, "truncated" tells that the accelerometer log went on.
+void sendAuxLog() {
+    if (magLoggedLength > 0) {
+        sendDatatype("MagnetometerLog");
+        sprintf(sbuf, "\"divider\":%d,\n\"samplingrate\":%d,\n\"samples\":%d,\n\"truncated\":%d,\n\"data\":[\n",
+            magLogDivider, accLogSamplingRate / magLogDivider, magLoggedLength, magLogTruncated);
+        sendString(sbuf);
+        for (int i=0; i<magLoggedLength; i++) {
+            int16_t *xyz = &arena.magLog[i*3];
+            sprintf(sbuf, "[%d,%d,%d]%s\n", xyz[0], xyz[1], xyz[2], (i < magLoggedLength-1) ? "," : "");
+            sendString(sbuf);
+        }
+        sendString("]}\n");
+    }
+    if (lightLoggedLength > 0) {
+        sendDatatype("LightSensorLog");
+        sprintf(sbuf, "\"divider\":%d,\n\"samplingrate\":%d,\n\"samples\":%d,\n\"truncated\":%d,\n\"data\":[\n",
+            lightLogDivider, accLogSamplingRate / lightLogDivider, lightLoggedLength, lightLogTruncated);
+        sendString(sbuf);
+        for (int i=0; i<lightLoggedLength; i++) {
+            sprintf(sbuf, "%u%s\n", arena.lightLog[i], (i < lightLoggedLength-1) ? "," : "");
+            sendString(sbuf);
+        }
+        sendString("]}\n");
+    }
+}
+#endif
+
+// The log as [pitch,roll,|a|] (centidegrees, mg), computed on the device.
+// Samples without a direction (|a| near 0) have pitch and roll 0.
+void sendOrientationLog() {
+    int factor = accFactor(accLogRange, accLogFastRead);
+    int length = accLoggedDataLength/3;
+
+    sendDatatype("OrientationLog");
+    sprintf(sbuf, "\"session\":%u,\n\"samplingrate\":%d,\n\"data\":[\n", (unsigned int)accLogSession, accLogSamplingRate);
+    sendString(sbuf);
+    for (int i=0; i<length; i++) {
+        if (accLogFastRead) {
+            const int8_t *log8 = (const int8_t*)accLog + i*3;
+            accXYZ[0] = log8[0];
+            accXYZ[1] = log8[1];
+            accXYZ[2] = log8[2];
+        } else {
+            memcpy(accXYZ, &accLog[i*3], sizeof(accXYZ));
+        }
+        computeOrientation(accXYZ, &accOrientation);
+        sprintf(sbuf, "[%d,%d,%d]%s\n", accOrientation.pitch, accOrientation.roll,
+            (int)(accOrientation.magnitude * 1000 / factor), (i < length-1) ? "," : "");
+        sendString(sbuf);
+    }
+    sendString("]}\n");
+}
+
+void sendSessionList() {
+    sendDatatype("LogSessions");
+    sprintf(sbuf, "\"writable\":%d,\n\"freesectors\":%d,\n\"sectorsize\":%d,\n\"sessions\":[\n",
+        logStore.writable() ? 1 : 0, logStore.freeSectors(), FLASH_SECTOR_SIZE);
+    sendString(sbuf);
+    for (int i=0; i<logStore.sessionCount(); i++) {
+        const LogSessionHeader *s = logStore.session(i);
+        sprintf(sbuf, "{\"id\":%u,\"samples\":%u,\"samplingrate\":%d,\"accelrange\":%d,\"accelfactor\":%d}%s\n",
+            (unsigned int)s->id, (unsigned int)s->length, s->samplingRate, s->range,
+            accFactor(s->range, s->fastRead), (i < logStore.sessionCount()-1) ? "," : "");
+        sendString(sbuf);
+    }
+    sendString("]}\n");
+}
+
+bool startTriggeredCapture(int level, int pre, int post) {
+    int capacity = accLogCapacity(_accelerometerFastRead);
+
+    if (level < 0 || pre < 0 || post < 1)
+        return false;
+
+    post = MIN(post, capacity);
+    pre = MIN(pre, capacity - post);
+
+    // The ring is sampled from the main loop, streaming would compete for the timing
+    accelerometerStreaming = 0;
+    orientationStreaming = 0;
+    touchStreaming = 0;
+#if defined(TARGET_KL46Z)
+    magStreaming = 0;
+    lightStreaming = 0;
+#endif
+
+    triggerLevel = level;
+    triggerPreSamples = pre;
+    triggerPostSamples = post;
+    triggerRingLength = pre + post;
+    triggerCount = 0;
+    triggerPostCount = -1;
+    hostTrigger = 0;
+
+    accLogRange = _accelerometerRange;
+    accLogFastRead = _accelerometerFastRead;
+    accLogSamplingRate = _stream_sampling_rate;
+    accLoggedDataLength = 0;
+    accLogSession = 0;
+    accLogPreTrigger = -1;
+#if defined(TARGET_KL46Z)
+    // The capture has no magnetometer or light data, drop those of an earlier log
+    magLoggedLength = 0;
+    lightLoggedLength = 0;
+    magLogTruncated = false;
+    lightLogTruncated = false;
+#endif
+
+#if defined(TARGET_KL46Z)
+    lcd.printf("TRIG");
+#endif
+    // Yellow LED while armed
+    setRGB(255,255,0);
+    startSampleClock();
+    currentState = TRIG_ACC_STATE;
+    return true;
+}
+
+void finishTriggeredCapture() {
+    int length = MIN(triggerCount, triggerRingLength);
+    if (triggerCount > triggerRingLength)
+        accLogRotate(length, triggerCount % triggerRingLength);
+
+    accLoggedDataLength = length*3;
+    accLogPreTrigger = length - triggerPostSamples;
+    accLogSession = logStore.save(accLog, length, accLogRange, accLogFastRead, accLogSamplingRate);
+
+#if defined(TARGET_KL46Z)
+    lcd.printf("DONE");
+#endif
+    if (sendNotifications)
+        sendString("{\"datatype\":\"Notification\",\"data\":\"LoggingEnded\"}\n");
+    setRGB(0,255,0);
+    currentState = IDLE_STATE;
+}
+
+void sendTrace() {
+    TraceEvent event;
+    bool first = true;
+
+    sendDatatype("Trace");
+    sendString("\"events\":[\n");
+    while (traceRead(&event)) {
+        sprintf(sbuf, "%s[%u,%d,%d,%u]", first ? "" : ",\n",
+            (unsigned int)event.timestamp, event.id, event.arg0, (unsigned int)event.arg1);
+        sendString(sbuf);
+        first = false;
+    }
+    sprintf(sbuf, "\n],\n\"dropped\":%u}\n", (unsigned int)traceDropped());
+    sendString(sbuf);
+}
+
+// One StreamData message (preceded by a rate change notification, if
+// any) in msg. "gap" tells the host how many samples were dropped right
+// before this one. Returns the length.
+int formatStreamSample(const StreamSample* sample, char* msg) {
+    char* p = msg;
+
+    if (streamRateChanged && sendNotifications)
+        p += sprintf(p, "{\"datatype\":\"Notification\",\"data\":\"SamplingRateChanged\",\"samplingrate\":%d}\n",
+            _stream_sampling_rate);
+
+    p += sprintf(p, "{\"datatype\":\"StreamData\",\n\"samplingrate\":%d,\n\"tick\":%u",
+        _stream_sampling_rate, (unsigned int)sample->tick);
+    if (sample->seq - streamLastSentSeq > 1)
+        p += sprintf(p, ",\n\"gap\":%u", (unsigned int)(sample->seq - streamLastSentSeq - 1));
+    if (sample->fields & STREAM_TOUCH)
+        p += sprintf(p, ",\n\"touchsensordata\":%d", sample->touch);
+    if (sample->fields & STREAM_ACC)
+        p += sprintf(p, ",\n\"accelrange\":%d,\n\"accelfactor\":%d,\n\"accelerometerdata\":[%d,%d,%d]",
+            _accelerometerRange, accFactor(_accelerometerRange, _accelerometerFastRead),
+            sample->acc[0],sample->acc[1],sample->acc[2]);
+    if (sample->fields & STREAM_ORIENTATION) {
+        computeOrientation(sample->acc, &accOrientation);
+        if (accOrientation.valid)
+            p += sprintf(p, ",\n\"orientation\":[%d,%d]", accOrientation.pitch, accOrientation.roll);
+        p += sprintf(p, ",\n\"accelmagnitude\":%d",
+            (int)(accOrientation.magnitude * 1000 / accFactor(_accelerometerRange, _accelerometerFastRead)));
+    }
+#if defined(TARGET_KL46Z)
+    if (sample->fields & STREAM_MAG)
+        p += sprintf(p, ",\n\"magnetometerdata\":[%d,%d,%d]", sample->mag[0], sample->mag[1], sample->mag[2]);
+    if (sample->fields & STREAM_LIGHT)
+        p += sprintf(p, ",\n\"lightsensordata\":%u", sample->light);
+#endif
+    p += sprintf(p, "\n}");
+    return p - msg;
+}
+
+// Send one StreamData message. If the write times out after the message
+// was started, the rest is kept in streamPending and sent before anything
+// else; only a message that couldn't be started at all is dropped.
+bool sendStreamSample(const StreamSample* sample) {
+    bool ok = sendStreamPending();
+    if (ok) {
+        int len = formatStreamSample(sample, arena.streamMsg);
+        int sent = sendBytes(arena.streamMsg, len);
+        streamPending = arena.streamMsg + sent;
+        streamPendingLength = (sent > 0) ? len - sent : 0;
+        ok = sent > 0;
+        if (ok)
+            streamRateChanged = false;
+    }
+
+    // A message that couldn't be started counts as dropped, the next one carries the gap
+    if (ok)
+        streamLastSentSeq = sample->seq;
+    else
+        streamDropped++;
+    return ok;
+}
+
+// Lower rate policy: halve the rate after STREAM_DROPS_TO_LOWER drops in
+// a row, double it again (up to the requested rate) after STREAM_RECOVER_S
+// seconds without drops. Changes are reported with the next message.
+void adaptStreamRate(bool sent) {
+    int rate = _stream_sampling_rate;
+
+    if (sent) {
+        streamDropRun = 0;
+        if (rate < streamRequestedRate && ++streamSentRun >= rate * STREAM_RECOVER_S)
+            rate = MIN(rate * 2, streamRequestedRate);
+    } else {
+        streamSentRun = 0;
+        if (rate > 1 && ++streamDropRun >= STREAM_DROPS_TO_LOWER)
+            rate = rate / 2;
+    }
+
+    if (rate != _stream_sampling_rate) {
+        setStreamSamplingRate(rate);
+        streamDropRun = 0;
+        streamSentRun = 0;
+        streamRateChanged = true;
+    }
+}
+
+// Hand a sample to the stream according to the overload policy
+void streamSample(StreamSample* sample) {
+    sample->seq = ++streamSeq;
+
+    switch (overloadPolicy) {
+        case OVERLOAD_DROP_OLDEST:
+            if (streamFifoCount == STREAM_FIFO_LENGTH) {
+                streamFifoHead = (streamFifoHead + 1) % STREAM_FIFO_LENGTH;
+                streamFifoCount--;
+                streamDropped++;
+            }
+            arena.streamFifo[(streamFifoHead + streamFifoCount) % STREAM_FIFO_LENGTH] = *sample;
+            streamFifoCount++;
+            while (streamFifoCount && webUSB.writeReady()) {
+                sendStreamSample(&arena.streamFifo[streamFifoHead]);
+                streamFifoHead = (streamFifoHead + 1) % STREAM_FIFO_LENGTH;
+                streamFifoCount--;
+            }
+            break;
+        case OVERLOAD_DROP_NEWEST:
+        case OVERLOAD_LOWER_RATE: {
+            bool sent = false;
+            if (webUSB.writeReady())
+                sent = sendStreamSample(sample);
+            else
+                streamDropped++;
+            if (overloadPolicy == OVERLOAD_LOWER_RATE)
+                adaptStreamRate(sent);
+            break;
+        }
+        default:
+            sendStreamSample(sample);
+    }
+}
+
 int params[10];
 
+// Integer value of a command, false if it doesn't parse (the value is then untouched)
+bool readInt(const char* valPtr, int* value) {
+    return sscanf(valPtr, "%i", value) == 1;
+}
+
+// Find the integer value of an optional "key":value field in a command
+bool findIntField(const char* buf, uint32_t size, const char* key, int* value) {
+    int keyLen = strlen(key);
+
+    for (uint32_t i = 1; i + keyLen + 2 < size; i++) {
+        char quote = buf[i-1];
+        if ((quote == '"' || quote == '\'') && strncmp(&buf[i], key, keyLen) == 0 &&
+            buf[i+keyLen] == quote && buf[i+keyLen+1] == ':')
+            return sscanf(&buf[i+keyLen+2], "%i", value) == 1;
+    }
+    return false;
+}
+
+void sendResponse(const char* cmd, int status) {
+    sendDatatype("Response");
+    sprintf(sbuf, "\"cmd\":\"%.6s\",\n\"status\":%d}\n", cmd, status);
+    sendString(sbuf);
+}
+
 void handleCMD(uint8_t* cmd_buf, uint32_t size) {
     // very crude "json" parsing. We should put e.g. picoJSON in place here
 
-    char *cmdPtr = (char*)(&cmd_buf[2]);
-    char *valPtr = (char*)(&cmd_buf[10]);
+    // Skip separators between pipelined commands
+    uint32_t start = 0;
+    while (start < size && cmd_buf[start] != '{')
+        start++;
+    if (size - start < 10)
+        return;
+
+    char *cmdPtr = (char*)(&cmd_buf[start+2]);
+    char *valPtr = (char*)(&cmd_buf[start+10]);
+    int status = STATUS_OK;
+
+    // Optional correlation id, echoed in all replies to this command
+    if (!findIntField((char*)&cmd_buf[start], size - start, "id", &commandId))
+        commandId = -1;
 
     if (strncmp(cmdPtr,"SETIDL",6) == 0){
         accelerometerStreaming = 0;
+        orientationStreaming = 0;
         touchStreaming = 0;
+#if defined(TARGET_KL46Z)
+        magStreaming = 0;
+        lightStreaming = 0;
+#endif
+        streamFifoCount = 0;
         setStreamSamplingRate(DEFAULT_SAMPLING_RATE);
+        streamRequestedRate = DEFAULT_SAMPLING_RATE;
+        streamRateChanged = false;
         currentState = IDLE_STATE;
     } else if (strncmp(cmdPtr,"LOGACC",6) == 0){
         currentState = LOG_ACC_STATE;
     } else if (strncmp(cmdPtr,"NOTIFY",6) == 0){
-        sscanf(valPtr,"%i",&sendNotifications);
+        if (!readInt(valPtr, &sendNotifications))
+            status = STATUS_INVALID_ARGUMENT;
+    } else if (strncmp(cmdPtr,"SETVRB",6) == 0){
+        if (!readInt(valPtr, &verbosity))
+            status = STATUS_INVALID_ARGUMENT;
 #if defined(TARGET_KL25Z)
     } else if (strncmp(cmdPtr,"SETRGB",6) == 0){
-        sscanf(valPtr,"[%d,%d,%d]",&params[0], &params[1], &params[2]);
-        setRGB(params[0], params[1], params[2]);
+        if (sscanf(valPtr,"[%d,%d,%d]",&params[0], &params[1], &params[2]) == 3)
+            setRGB(params[0], params[1], params[2]);
+        else
+            status = STATUS_INVALID_ARGUMENT;
 #elif defined(TARGET_KL46Z)
     } else if (strncmp(cmdPtr,"SETLCD",6) == 0){
         // TODO:  Set LCD string...
+    } else if (strncmp(cmdPtr,"MAGRTE",6) == 0){
+        if (readInt(valPtr, &params[0]) && params[0] >= 0 && params[0] <= _stream_sampling_rate)
+            magRate = params[0];
+        else
+            status = STATUS_INVALID_ARGUMENT;
+    } else if (strncmp(cmdPtr,"LGTRTE",6) == 0){
+        if (readInt(valPtr, &params[0]) && params[0] >= 0 && params[0] <= _stream_sampling_rate)
+            lightRate = params[0];
+        else
+            status = STATUS_INVALID_ARGUMENT;
+    } else if (strncmp(cmdPtr,"STRMAG",6) == 0){
+        if (currentState == TRIG_ACC_STATE)
+            status = STATUS_FAILED;     // The armed capture owns the sample clock
+        else if (!readInt(valPtr, &magStreaming))
+            status = STATUS_INVALID_ARGUMENT;
+    } else if (strncmp(cmdPtr,"STRLGT",6) == 0){
+        if (currentState == TRIG_ACC_STATE)
+            status = STATUS_FAILED;     // The armed capture owns the sample clock
+        else if (!readInt(valPtr, &lightStreaming))
+            status = STATUS_INVALID_ARGUMENT;
 #endif
     } else if (strncmp(cmdPtr,"SETRTE",6) == 0){
-        sscanf(valPtr,"%i",&params[0]);
-        setStreamSamplingRate(params[0]);
+        if (readInt(valPtr, &params[0]) && setStreamSamplingRate(params[0])) {
+            streamRequestedRate = params[0];
+            streamDropRun = 0;
+            streamSentRun = 0;
+        } else {
+            status = STATUS_INVALID_ARGUMENT;
+        }
     } else if (strncmp(cmdPtr,"STRTCH",6) == 0){
-        sscanf(valPtr,"%i",&touchStreaming);
+        if (currentState == TRIG_ACC_STATE)
+            status = STATUS_FAILED;     // The armed capture owns the sample clock
+        else if (!readInt(valPtr, &touchStreaming))
+            status = STATUS_INVALID_ARGUMENT;
     } else if (strncmp(cmdPtr,"STRACC",6) == 0){
-        sscanf(valPtr,"%i",&accelerometerStreaming);
+        if (currentState == TRIG_ACC_STATE)
+            status = STATUS_FAILED;     // The armed capture owns the sample clock
+        else if (!readInt(valPtr, &accelerometerStreaming))
+            status = STATUS_INVALID_ARGUMENT;
+    } else if (strncmp(cmdPtr,"STRORI",6) == 0){
+        if (currentState == TRIG_ACC_STATE)
+            status = STATUS_FAILED;     // The armed capture owns the sample clock
+        else if (!readInt(valPtr, &orientationStreaming))
+            status = STATUS_INVALID_ARGUMENT;
+    } else if (strncmp(cmdPtr,"SETRNG",6) == 0){
+        if (currentState == TRIG_ACC_STATE)
+            status = STATUS_FAILED;     // The armed capture keeps the settings it was started with
+        else if (!readInt(valPtr, &params[0]) || !accSetRange(params[0]))
+            status = STATUS_INVALID_ARGUMENT;
+    } else if (strncmp(cmdPtr,"SETODR",6) == 0){
+        if (!readInt(valPtr, &params[0]) || !accSetDataRate(params[0]))
+            status = STATUS_INVALID_ARGUMENT;
+    } else if (strncmp(cmdPtr,"SETRES",6) == 0){
+        if (currentState == TRIG_ACC_STATE)
+            status = STATUS_FAILED;     // The armed capture keeps the settings it was started with
+        else if (!readInt(valPtr, &params[0]) || !accSetResolution(params[0]))
+            status = STATUS_INVALID_ARGUMENT;
+    } else if (strncmp(cmdPtr,"SETGST",6) == 0){
+        if (sscanf(valPtr,"[%d,%d,%d,%d,%d]",&params[0], &params[1], &params[2], &params[3], &params[4]) == 5 &&
+            params[0] > 0 && params[1] > params[0] && params[1] <= 60000 &&
+            params[2] >= 0 && params[3] > params[2] && params[3] <= 40 &&
+            params[4] > 0 && params[4] <= 60000) {
+            gestures.settings.tapMaxMs = params[0];
+            gestures.settings.holdMinMs = params[1];
+            gestures.settings.stillMaxMm = params[2];
+            gestures.settings.swipeMinMm = params[3];
+            gestures.settings.swipeMinSpeed = params[4];
+        } else {
+            status = STATUS_INVALID_ARGUMENT;
+        }
+    } else if (strncmp(cmdPtr,"SETOVL",6) == 0){
+        if (readInt(valPtr, &params[0]) && params[0] >= OVERLOAD_BLOCK && params[0] <= OVERLOAD_LOWER_RATE) {
+            overloadPolicy = params[0];
+            applyWriteTimeout();
+            streamFifoCount = 0;
+            // Back to the requested rate if the lower rate policy had lowered it
+            streamDropRun = 0;
+            streamSentRun = 0;
+            if (_stream_sampling_rate != streamRequestedRate) {
+                setStreamSamplingRate(streamRequestedRate);
+                streamRateChanged = true;
+            }
+        } else {
+            status = STATUS_INVALID_ARGUMENT;
+        }
+    } else if (strncmp(cmdPtr,"GETSTA",6) == 0){
+        sendStatistics();
+    } else if (strncmp(cmdPtr,"GETTRC",6) == 0){
+        sendTrace();
     } else if (strncmp(cmdPtr,"GETINF",6) == 0){
         sendHardwareInformation();
+    } else if (strncmp(cmdPtr,"TRGACC",6) == 0){
+        if (sscanf(valPtr,"[%d,%d,%d]",&params[0], &params[1], &params[2]) != 3 ||
+            !startTriggeredCapture(params[0], params[1], params[2]))
+            status = STATUS_INVALID_ARGUMENT;
+    } else if (strncmp(cmdPtr,"TRIGGR",6) == 0){
+        if (currentState == TRIG_ACC_STATE)
+            hostTrigger = 1;
+        else
+            status = STATUS_FAILED;
     } else if (strncmp(cmdPtr,"GETLOG",6) == 0){
-        currentState = GET_LOG_STATE;
+        sendAccLog(accLog, accLoggedDataLength/3, accLogRange, accLogFastRead, accLogSamplingRate, accLogSession, accLogPreTrigger);
+#if defined(TARGET_KL46Z)
+        sendAuxLog();
+#endif
+    } else if (strncmp(cmdPtr,"GETORI",6) == 0){
+        sendOrientationLog();
+    } else if (strncmp(cmdPtr,"LSTSES",6) == 0){
+        sendSessionList();
+    } else if (strncmp(cmdPtr,"GETSES",6) == 0){
+        const LogSessionHeader *s = readInt(valPtr, &params[0]) ? logStore.findSession(params[0]) : 0;
+        if (s)
+            sendAccLog(logStore.sessionData(s), s->length, s->range, s->fastRead, s->samplingRate, s->id, -1);
+        else
+            status = STATUS_INVALID_ARGUMENT;
+    } else if (strncmp(cmdPtr,"ERSSES",6) == 0){
+        // A value that doesn't parse must not end up as 0 (erase all)
+        if (!readInt(valPtr, &params[0])) {
+            status = STATUS_INVALID_ARGUMENT;
+        } else if (!logStore.writable()) {
+            status = STATUS_FAILED;
+        } else if (params[0] == 0) {
+            if (!logStore.eraseAll())
+                status = STATUS_FAILED;
+        } else if (!logStore.erase(params[0])) {
+            status = STATUS_INVALID_ARGUMENT;
+        }
     } else {
         // send help string
         sendString(helpString);
+        status = STATUS_UNKNOWN_COMMAND;
     }
-}
 
+    // Without an id, only errors are reported (as before for the host tools)
+    if (commandId >= 0 || status != STATUS_OK)
+        sendResponse(cmdPtr, status);
 
-#define MAX_BUF_SIZE 1024
+    commandId = -1;
+}
+
+// Take the next recognized touch gesture and tell the host about it
+GESTURE_TYPE takeGesture() {
+    GESTURE_TYPE gesture = gestures.read();
+    if (gesture != GESTURE_NONE && sendNotifications) {
+        sprintf(sbuf, "{\"datatype\":\"Notification\",\"data\":\"%s\"}\n", gestureName(gesture));
+        sendString(sbuf);
+    }
+    return gesture;
+}
 
-int count = 0;
+int logLength = 0;
+unsigned int streamTick = 0;    // Master timebase of the stream, one tick per sampling period
 
 int main()
 {
@@ -157,61 +778,75 @@ int main()
     setRGB(255,0,0);
 #endif
 
+    // The static data (arena included) must leave room for the heap and the stack
+    if (ramFree() < RAM_MIN_FREE) {
+#if defined(TARGET_KL25Z)
+        setRGB(255,0,0);
+#elif defined(TARGET_KL46Z)
+        lcd.printf("ERAM");
+#endif
+        while (true);
+    }
 
-    rbuf = new uint8_t[MAX_BUF_SIZE];
-    rbuf_cdc = new uint8_t[MAX_BUF_SIZE];
-
-    sbuf = new char[200];
+    accApplySettings();
+#if defined(TARGET_KL46Z)
+    magInit();
+#endif
 
-    accLog = new int16_t[ACC_LOG_SIZE];
+    logStore.init();
 
     currentState = IDLE_STATE;
 
     // Indicate power on with green LED
-    if (accLog)
-        setRGB(0,255,0);
-    else {
-        setRGB(255,0,0);
-        while(1);
-    }
+    setRGB(0,255,0);
+
 
+    // Start the sample clock - used for precision sampling rate
+    startSampleClock();
 
-    // Start the timer - used for precision sampling rate
-    loopTimer.reset();
-    loopTimer.start();
+    touchTicker.attach_us(&touchPoll, TOUCH_POLL_US);
 
     while (true) {
         // try to read from endpoint
         if(webUSB.read(&rbuf[rbuf_len], &read_size)) {
-            sprintf(sbuf, "{\"msg\":\"Read %d bytes\"}",(int)read_size);
-            sendString(sbuf);
+            if (verbosity >= VERBOSITY_DEBUG) {
+                sprintf(sbuf, "{\"msg\":\"Read %d bytes\"}",(int)read_size);
+                sendString(sbuf);
+            }
 
             rbuf_len += read_size;
-            if(rbuf_len+MAX_PACKET_SIZE_EPBULK >= MAX_BUF_SIZE) {
+            if(rbuf_len+MAX_PACKET_SIZE_EPBULK >= RX_BUF_SIZE) {
                 // we are too close to the buffer limit (crude handling)
                 rbuf_len = 0;
             }
+            // rbuf queues pipelined commands, all complete ones are handled in order
             uint32_t buf_pos = 0;
             while(rbuf_len && buf_pos < rbuf_len) {
                 // crude "find the '}'"
                 if(rbuf[buf_pos] == '}') {
-                    sprintf(sbuf, "{\"msg\":\"Found end bracket at pos: %d\"}",(int)buf_pos);
-                    sendString(sbuf);
+                    if (verbosity >= VERBOSITY_DEBUG) {
+                        sprintf(sbuf, "{\"msg\":\"Found end bracket at pos: %d\"}",(int)buf_pos);
+                        sendString(sbuf);
+                    }
 
                     handleCMD(rbuf, buf_pos+1);
                     memmove(rbuf, &rbuf[buf_pos+1], rbuf_len-(buf_pos+1));
                     rbuf_len-=buf_pos+1;
+                    buf_pos = 0;
+                    continue;
                 }
                 buf_pos++;
             }
         }
 
+        GESTURE_TYPE gesture = takeGesture();
+
         // Handle state
         switch (currentState) {
             case IDLE_STATE:
                 // TODO add battery status monitoring, USB connected?
 #if defined(XXTARGET_KL46Z)
-                    sprintf(lcdMessage, "%04d", tsi.readDistance());
+                    sprintf(lcdMessage, "%04d", gestures.position());
                     lcd.printf(lcdMessage);
 #endif
                 break;
@@ -219,17 +854,16 @@ int main()
 #if defined(TARGET_KL46Z)
                     lcd.printf("LACC");
 #endif
-                count = (count<3)?count+1:0;
-                if (tsi.readDistance() > 20)  // Should do:  Proper swipe detection.
+                if (gestureIsSwipe(gesture))
                     currentState = ACC_READY_STATE;
-                else if (tsi.readDistance() > 0) {
+                else if (gestures.position() > 0) {
 #if defined(TARGET_KL25Z)
-                    setRGB(0,0,tsi.readDistance() * 12);
+                    setRGB(0,0,gestures.position() * 12);
 #elif defined(TARGET_KL46Z)
-                    sprintf(lcdMessage, "%04d", tsi.readDistance());
+                    sprintf(lcdMessage, "%04d", gestures.position());
                     lcd.printf(lcdMessage);
 #endif
-                } else if (count == 0)
+                } else if ((us_ticker_read() / 100000) % 4 == 0)   // Blink green, 100 ms of every 400
                     setRGB(0,255,0);
                 else
                     setRGB(0,0,0);
@@ -250,35 +884,63 @@ int main()
                     lcd.printf(lcdMessage);
 #endif
                 }
+                // Gestures made during the countdown don't stop the log
+                while (gestures.read() != GESTURE_NONE);
                 // Constant red LED to indicate recording
                 // The following line is commented out (for now) as we get a crash if we send data and are not connected.
                 if (sendNotifications)
                     sendString("{\"datatype\":\"Notification\",\"data\":\"LoggingStarted\"}\n");
                 setRGB(255,0,0);
-                accLoggedDataLength = ACC_LOG_LENGTH*3;
-                timer.reset();
-                timer.start();
-                accLogPtr = accLog; // Point at the beginning
+                // 8-bit samples are packed as int8_t, doubling the log length
+                accLogRange = _accelerometerRange;
+                accLogFastRead = _accelerometerFastRead;
+                accLogSamplingRate = _stream_sampling_rate;
+                logLength = accLogCapacity(accLogFastRead);
+                accLogPreTrigger = -1;
+                accLoggedDataLength = logLength*3;
+#if defined(TARGET_KL46Z)
+                magLogDivider = sensorDivider(magRate);
+                lightLogDivider = sensorDivider(lightRate);
+                magLoggedLength = 0;
+                lightLoggedLength = 0;
+                magLogTruncated = false;
+                lightLogTruncated = false;
+#endif
+                startSampleClock();
 #if defined(TARGET_KL46Z)
                 lcd.DP2(1);
 #endif
-                for (int i=0; i<ACC_LOG_LENGTH; i++) {
-                    acc.getAccAllAxis(accLogPtr);
-                    accLogPtr += 3; // Check that this works... might need ++ three times.
+                for (int i=0; i<logLength; i++) {
+                    accReadAllAxis(accXYZ);
+                    accLogWrite(i, accXYZ);
 #if defined(TARGET_KL46Z)
+                    if (sensorDue(magLogDivider, i)) {
+                        if (magLoggedLength < MAG_LOG_LENGTH)
+                            magReadAllAxis(&arena.magLog[3 * magLoggedLength++]);
+                        else
+                            magLogTruncated = true;
+                    }
+                    if (sensorDue(lightLogDivider, i)) {
+                        if (lightLoggedLength < LIGHT_LOG_LENGTH)
+                            arena.lightLog[lightLoggedLength++] = lightSensor.read_u16();
+                        else
+                            lightLogTruncated = true;
+                    }
                     sprintf(lcdMessage, "%3ds", i/5);
                     lcd.printf(lcdMessage);
 #endif
-                    while( timer.read_us() < _stream_sampling_wait_us );
-                    timer.reset();
+                    waitForNextSample();
 
-                    // Check if user swiped to stop logging (TODO: actual swipe detection ;))
-                    if (tsi.readDistance() > 20){
+                    // Check if user swiped to stop logging
+                    if (gestureIsSwipe(takeGesture())){
                         accLoggedDataLength = i*3;
                         break;
                     }
                 }
-                timer.stop();
+                if (accLoggedDataLength > 0)
+                    accLogSession = logStore.save(accLog, accLoggedDataLength/3, accLogRange, accLogFastRead, accLogSamplingRate);
+                else
+                    accLogSession = 0;
 #if defined(TARGET_KL46Z)
                 lcd.DP2(0);
                 lcd.printf("DONE");
@@ -290,56 +952,78 @@ int main()
                 setRGB(0,255,0);
                 currentState = IDLE_STATE;  // Done, switch back
                 break;
-            case GET_LOG_STATE:
-                sprintf(sbuf, "{\"datatype\":\"AccelerometerLog\",\n" \
-                             "\"accelrange\":%d,\n" \
-                             "\"accelfactor\":%d,\n" \
-                             "\"samplingrate\":%d,\n" \
-                             "\"data\":[\n",  _accelerometerRange, 8192 / _accelerometerRange, _stream_sampling_rate);
-                sendString(sbuf);
-                for (int i=0; i<accLoggedDataLength; i=i+3) {
-                    if (i<(accLoggedDataLength-3))
-                        sprintf(sbuf,"[%d,%d,%d],\n",accLog[i],accLog[i+1],accLog[i+2]);
-                    else
-                        sprintf(sbuf,"[%d,%d,%d]\n",accLog[i],accLog[i+1],accLog[i+2]);
-                    sendString(sbuf);
+            case TRIG_ACC_STATE:
+                // One sample per pass so commands (TRIGGR, SETIDL) are still handled
+                waitForNextSample();
+                accReadAllAxis(accXYZ);
+                accLogWrite(triggerCount % triggerRingLength, accXYZ);
+                triggerCount++;
+
+                if (triggerPostCount < 0) {
+                    if (hostTrigger || gesture == GESTURE_TAP || gestureIsSwipe(gesture) ||
+                        (triggerLevel && accMagnitudeAbove(accXYZ, triggerLevel))) {
+                        // The trigger sample is the first post-trigger sample
+                        triggerPostCount = triggerPostSamples - 1;
+                        if (sendNotifications)
+                            sendString("{\"datatype\":\"Notification\",\"data\":\"Triggered\"}\n");
+                        setRGB(255,0,0);
+                    }
+                } else if (triggerPostCount > 0) {
+                    triggerPostCount--;
                 }
-                sendString("]}\n");
-                currentState = IDLE_STATE;  // Done, switch back
+
+                if (triggerPostCount == 0)
+                    finishTriggeredCapture();
                 break;
             default:
                 sendString("{\"datatype\":\"StatusMessage\",\"data\":\"Unexpected state.\"}\n");
         }
 
-        if (touchStreaming || accelerometerStreaming) {
-            // Use the high precision timer
-            while( loopTimer.read_us() < _stream_sampling_wait_us );
-            loopTimer.reset();
-            if (touchStreaming)
-                touchValue = tsi.readDistance();
-            if (accelerometerStreaming)
-                acc.getAccAllAxis(accXYZ);
-            // Separate reading and printing for better precision
-            sprintf(sbuf, "{\"datatype\":\"StreamData\",\n\"samplingrate\":%d", _stream_sampling_rate);
-            sendString(sbuf);
+#if defined(TARGET_KL46Z)
+        bool auxStreaming = (magStreaming && magRate) || (lightStreaming && lightRate);
+#else
+        bool auxStreaming = false;
+#endif
+        if (touchStreaming || accelerometerStreaming || orientationStreaming || auxStreaming) {
+            // Use the high precision sample clock. Periods that passed without
+            // a sample are dropped samples, the next message shows the gap.
+            int missed = waitForNextSample();
+            streamTick += missed;
+            if (missed && (touchStreaming || accelerometerStreaming || orientationStreaming)) {
+                streamSeq += missed;
+                streamDropped += missed;
+                if (overloadPolicy == OVERLOAD_LOWER_RATE)
+                    adaptStreamRate(false);
+            }
+
+            StreamSample sample;
+            sample.tick = streamTick++;
+            sample.fields = 0;
             if (touchStreaming) {
-                sprintf(sbuf, ",\n\"touchsensordata\":%d", touchValue);
-                sendString(sbuf);
+                sample.touch = gestures.position();
+                sample.fields |= STREAM_TOUCH;
             }
-            if (accelerometerStreaming) {
-                sprintf(sbuf, ",\n\"accelerometerdata\":[%d,%d,%d]",accXYZ[0],accXYZ[1],accXYZ[2]);
-                sendString(sbuf);
+            if (accelerometerStreaming || orientationStreaming) {
+                accReadAllAxis(sample.acc);
+                sample.fields |= (accelerometerStreaming ? STREAM_ACC : 0) | (orientationStreaming ? STREAM_ORIENTATION : 0);
             }
-            sendString("\n}");
-        } else {
-            wait_ms(100);
-            loopTimer.reset();  // keep it ready
+#if defined(TARGET_KL46Z)
+            if (magStreaming && sensorDue(sensorDivider(magRate), sample.tick)) {
+                magReadAllAxis(sample.mag);
+                sample.fields |= STREAM_MAG;
+            }
+            if (lightStreaming && sensorDue(sensorDivider(lightRate), sample.tick)) {
+                sample.light = lightSensor.read_u16();
+                sample.fields |= STREAM_LIGHT;
+            }
+#endif
+            // Nothing to send on ticks where only slow sensors are streamed and none are due
+            if (sample.fields)
+                streamSample(&sample);
+        } else if (currentState != TRIG_ACC_STATE) {
+            // Short enough that gestures are handled within a touch poll period
+            wait_us(TOUCH_POLL_US);
+            startSampleClock();  // keep it ready
         }
-
-
-        // if(webUSB.read(rbuf_cdc, &read_size_cdc, true)) {
-        //     rbuf_cdc[read_size_cdc] = 0;
-        //     webUSB.write(rbuf_cdc, read_size_cdc);
-        // }
     }
 }